@@ -0,0 +1,160 @@
+#ifndef _augment_h
+#define _augment_h
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+
+#include "mnist.h"
+#include "network.h"
+
+// random distortions of 28x28 images - a shift, a rotation about the
+// centre, a smooth elastic displacement and gaussian noise. each distortion
+// is drawn from a key, so a sample comes out the same whichever thread
+// makes it. everything but the four taps of the bilinear lookup is a
+// whole-image array expression, and the taps are a branch-free gather
+struct Augmenter {
+    // largest shift in pixels, each way
+    double shift = 0;
+    // largest rotation in degrees, each way
+    double rotation = 0;
+    // largest elastic displacement in pixels
+    double elastic = 0;
+    // standard deviation of the noise added to every pixel
+    double noise = 0;
+
+    bool enabled() const {
+        return shift > 0 || rotation > 0 || elastic > 0 || noise > 0;
+    }
+
+    // write distortion `key` of the image `in` to `out`
+    void apply(const scalar *in, scalar *out, const uint64_t key) const {
+        typedef Eigen::Array<scalar, 28, 28, Eigen::RowMajor> Image;
+        Random random{key};
+        std::uniform_real_distribution<scalar> uniform(-1, 1);
+
+        const scalar dx = shift * uniform(random);
+        const scalar dy = shift * uniform(random);
+        const scalar angle = rotation * M_PI / 180 * uniform(random);
+        const scalar c = std::cos(angle);
+        const scalar s = std::sin(angle);
+
+        // where each output pixel is read from, relative to the centre
+        const Image &x = grid().x;
+        const Image &y = grid().y;
+        Image u = c * (x - dx) + s * (y - dy) + scalar(13.5);
+        Image v = c * (y - dy) - s * (x - dx) + scalar(13.5);
+
+        // elastic displacement is random on a coarse grid of control
+        // points, interpolated up to full size
+        if (elastic > 0) {
+            Eigen::Matrix<scalar, CONTROL, CONTROL> cu, cv;
+            for (int i = 0; i < CONTROL * CONTROL; ++i) {
+                cu(i) = elastic * uniform(random);
+                cv(i) = elastic * uniform(random);
+            }
+            u += (grid().up * cu * grid().up.transpose()).array();
+            v += (grid().up * cv * grid().up.transpose()).array();
+        }
+
+        // bilinear lookup in a copy of the image with a zero border, so
+        // clamping the coordinates to the border makes every tap valid and
+        // lands whatever falls outside on zeros
+        Padded padded = Padded::Zero();
+        padded.block<28, 28>(1, 1) = Eigen::Map<const Image>(in);
+        u = u.max(scalar(-1)).min(scalar(28));
+        v = v.max(scalar(-1)).min(scalar(28));
+        const Image fu = u.floor();
+        const Image fv = v.floor();
+        const Image a = u - fu;
+        const Image b = v - fv;
+        const Eigen::Array<int, 28, 28, Eigen::RowMajor> k = 
+                (fv + 1).cast<int>() * PADDED + (fu + 1).cast<int>();
+
+        Image t00, t01, t10, t11;
+        const scalar *p = padded.data();
+        for (int i = 0; i < 784; ++i) {
+            t00(i) = p[k(i)];
+            t01(i) = p[k(i) + 1];
+            t10(i) = p[k(i) + PADDED];
+            t11(i) = p[k(i) + PADDED + 1];
+        }
+        Eigen::Map<Image> image(out);
+        image = (1 - b) * ((1 - a) * t00 + a * t01) + b * ((1 - a) * t10 + a * t11);
+
+        // gaussian noise by box-muller, a pair of values per pair of
+        // uniform draws, over half the image each
+        if (noise > 0) {
+            Eigen::Array<scalar, 392, 1> r, t;
+            for (int i = 0; i < 392; ++i) {
+                r(i) = random.unit();
+                t(i) = random.unit();
+            }
+            r = (scalar(-2) * r.log()).sqrt() * scalar(noise);
+            t *= scalar(2 * M_PI);
+            Eigen::Map<Eigen::Array<scalar, 784, 1>> flat(out);
+            flat.head<392>() += r * t.cos();
+            flat.tail<392>() += r * t.sin();
+            image = image.max(scalar(0)).min(scalar(1));
+        }
+    }
+
+private:
+    static const int CONTROL = 4;
+
+    // the image with a zero border: one row and column before, three after
+    static const int PADDED = 32;
+    typedef Eigen::Array<scalar, PADDED, PADDED, Eigen::RowMajor> Padded;
+
+    // splitmix64 counter, cheap to start per sample
+    struct Random {
+        typedef uint64_t result_type;
+        uint64_t state;
+
+        static constexpr uint64_t min() {
+            return 0;
+        }
+
+        static constexpr uint64_t max() {
+            return std::numeric_limits<uint64_t>::max();
+        }
+
+        uint64_t operator()() {
+            return mnist::mix(state++);
+        }
+
+        // uniform in (0, 1)
+        scalar unit() {
+            return ((*this)() >> 11 | 1) * scalar(1.0 / (uint64_t(1) << 53));
+        }
+    };
+
+    // pixel coordinates relative to the centre and the control point
+    // interpolation matrix, shared by every call
+    struct Grid {
+        Eigen::Array<scalar, 28, 28, Eigen::RowMajor> x, y;
+        Eigen::Matrix<scalar, 28, CONTROL> up;
+
+        Grid() {
+            for (int i = 0; i < 28; ++i) {
+                for (int j = 0; j < 28; ++j) {
+                    x(i,j) = j - scalar(13.5);
+                    y(i,j) = i - scalar(13.5);
+                }
+                const scalar t = scalar(i) * (CONTROL - 1) / 27;
+                const int k = std::min<int>(t, CONTROL - 2);
+                up.row(i).setZero();
+                up(i,k) = k + 1 - t;
+                up(i,k+1) = t - k;
+            }
+        }
+    };
+
+    static const Grid &grid() {
+        static const Grid g;
+        return g;
+    }
+};
+
+#endif
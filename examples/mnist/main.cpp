@@ -3,13 +3,24 @@
 #include <unistd.h>
 #include <cmath>
 #include <signal.h>
+#include <thread>
+#include <memory>
+#include <sstream>
+#include <numeric>
+#include <type_traits>
 
 #include "mnist.h"
 #include "network.h"
+#include "prefetch.h"
 #include "hack.h"
 
 const int MAX_TRAIN_SIZE = 60000;
 const int MAX_TEST_SIZE = 10000;
+const int TEST_BATCH_SIZE = 100;
+const int HOGWILD_CHUNK = 1000;
+const int CALIBRATION_SIZE = 1000;
+// threads the background test of -o takes out of -j while it runs
+const int EVAL_THREADS = 1;
 const double PI = 3.1415926535897;
 
 
@@ -24,11 +35,23 @@ double batch_flux_amount = 0;
 double batch_size_decay = 1;
 double weight_decay = 0;
 int num_epochs = 1;
+int num_threads = 0;
+int num_loaders = 0;
+int shuffle_seed = 0;
+int shuffle_block = 1;
+Augmenter augment;
+bool hogwild = false;
+bool quantized = false;
+bool overlap = false;
 bool verbose = false;
 
 volatile bool has_signal = false;
 void onsignal(int);
 void menu();
+void calibrate(Network &network, Dataset &data);
+void test(Network &network, Dataset &data, const int epoch, 
+          const int tests, const bool quantize, const bool interactive,
+          std::ostream &out);
 
 int main(int argc, char **argv) {
 
@@ -37,7 +60,7 @@ int main(int argc, char **argv) {
     signal(SIGINT, onsignal);
 
     int c;
-    while ((c = getopt(argc, argv, "e:a:w:t:n:b:f:F:d:E:vh")) != -1) {
+    while ((c = getopt(argc, argv, "e:a:w:t:n:b:f:F:d:E:j:l:s:B:S:R:D:N:Hqovh")) != -1) {
         switch (c) {
             case_double_arg('e', eta, eta > 0 && eta <= 1);
             case_double_arg('a', alpha, alpha >= 0 && alpha <= 1);
@@ -49,8 +72,16 @@ int main(int argc, char **argv) {
             case_double_arg('F', batch_flux_amount, true);
             case_double_arg('d', batch_size_decay, batch_size_decay >= 0);
             case_int_arg('E', num_epochs, num_epochs > 0);
+            case_int_arg('j', num_threads, num_threads > 0);
+            case_int_arg('l', num_loaders, num_loaders >= 0);
+            case_int_arg('s', shuffle_seed, shuffle_seed >= 0);
+            case_int_arg('B', shuffle_block, shuffle_block > 0);
+            case_double_arg('S', augment.shift, augment.shift >= 0);
+            case_double_arg('R', augment.rotation, augment.rotation >= 0);
+            case_double_arg('D', augment.elastic, augment.elastic >= 0);
+            case_double_arg('N', augment.noise, augment.noise >= 0);
             case 'h':
-                std::cout << "usage: " << argv[0] << " [-eawtnbfFdEvh]\n"
+                std::cout << "usage: " << argv[0] << " [-eawtnbfFdEjlsBSRDNHqovh]\n"
                           << "    -e eta                [0.1]\n"
                           << "    -a alpha              [0.0]\n"
                           << "    -w weight_decay       [0.0]\n"
@@ -61,10 +92,30 @@ int main(int argc, char **argv) {
                           << "    -F batch_flux_amount  [0.0]\n"
                           << "    -d batch_size_decay   [0.0]\n"
                           << "    -E num_epochs         [1]\n"
+                          << "    -j num_threads        [all]\n"
+                          << "    -l num_loaders        [0]\n"
+                          << "    -s shuffle_seed       [0, off]\n"
+                          << "    -B shuffle_block      [1]\n"
+                          << "    -S augment shift      [0.0]\n"
+                          << "    -R augment rotation   [0.0]\n"
+                          << "    -D augment elastic    [0.0]\n"
+                          << "    -N augment noise      [0.0]\n"
+                          << "    -H hogwild            [false]\n"
+                          << "    -q int8 test          [false]\n"
+                          << "    -o overlap test       [false]\n"
                           << "    -v verbose            [false]\n"
                           << "    -h help\n"
                           << "\n";
                 return EXIT_SUCCESS;
+            case 'H':
+                hogwild = true;
+                break;
+            case 'q':
+                quantized = true;
+                break;
+            case 'o':
+                overlap = true;
+                break;
             case 'v':
                 verbose = true;
                 break;
@@ -75,6 +126,17 @@ int main(int argc, char **argv) {
         }
     }
 
+    // hogwild steps are plain SGD, with no momentum or optimizer state
+    if (hogwild && (alpha > 0 || !std::is_same<optimizer, nn::Momentum>::value)) {
+        fail_usage("-H needs -a 0 and the Momentum optimizer");
+    }
+
+#ifdef _OPENMP
+    if (num_threads > 0) {
+        omp_set_num_threads(num_threads);
+    }
+#endif
+
     std::cout << "parameters:\n"
               << "    eta: (-e)                 " << eta << "\n"
               << "    alpha: (-a)               " << alpha << "\n"
@@ -86,15 +148,56 @@ int main(int argc, char **argv) {
               << "    batch_flux_amount: (-F)   " << batch_flux_amount << "\n"
               << "    batch_size_decay: (-d)    " << batch_size_decay << "\n"
               << "    num_epochs: (-E)          " << num_epochs << "\n"
-              << "    threads:                  " << Eigen::nbThreads() << "\n"
+              << "    threads: (-j)             " << nn::max_threads() << "\n"
+              << "    loaders: (-l)             " << num_loaders << "\n"
+              << "    shuffle seed: (-s)        " << shuffle_seed << "\n"
+              << "    shuffle block: (-B)       " << shuffle_block << "\n"
+              << "    augment shift: (-S)       " << augment.shift << "\n"
+              << "    augment rotation: (-R)    " << augment.rotation << "\n"
+              << "    augment elastic: (-D)     " << augment.elastic << "\n"
+              << "    augment noise: (-N)       " << augment.noise << "\n"
+              << "    hogwild: (-H)             " << hogwild << "\n"
+              << "    int8 test: (-q)           " << quantized << "\n"
+              << "    overlap test: (-o)        " << overlap << "\n"
               << "\n";
     
     Network network;
-    mnist::DB train_data("train-labels-idx1-ubyte", "train-images-idx3-ubyte");
-    mnist::DB test_data("t10k-labels-idx1-ubyte", "t10k-images-idx3-ubyte");
+    Dataset train_data("train-labels-idx1-ubyte", "train-images-idx3-ubyte");
+    Dataset test_data("t10k-labels-idx1-ubyte", "t10k-images-idx3-ubyte");
 
-    int batch_idx = 0;
-    double error_rate;
+    // weights the background test runs on, only made for -o
+    std::unique_ptr<Network> snapshot;
+    if (overlap) {
+        snapshot.reset(new Network);
+    }
+    std::thread evaluation;
+
+    // the background test's result, held back until it is joined so it
+    // can't interleave with what the main thread prints meanwhile
+    std::ostringstream report;
+    auto join_evaluation = [&] {
+        if (evaluation.joinable()) {
+            evaluation.join();
+            std::cout << report.str();
+            report.str("");
+        }
+    };
+
+    // -j, split between training and the background test while one runs
+    const int threads = nn::max_threads();
+    const int train_threads = std::max(1, threads - EVAL_THREADS);
+
+    // order the training samples are visited in this epoch
+    std::vector<size_t> order;
+
+    // packs minibatches in the background when loaders are asked for, 
+    // or to augment them
+    std::unique_ptr<Prefetcher> prefetch;
+    if (augment.enabled()) {
+        prefetch.reset(new Prefetcher(train_data, std::max(num_loaders, 1), &augment));
+    } else if (num_loaders > 0) {
+        prefetch.reset(new Prefetcher(train_data, num_loaders));
+    }
 
     for (int epoch = 0; epoch < num_epochs; ++epoch) {
 
@@ -109,55 +212,166 @@ int main(int argc, char **argv) {
                                 * (1.0 + batch_flux_amount * std::sin(2.0 * PI * epoch * batch_flux_rate)) / 2));
                   
         //
-        // train
+        // train - in a fresh random order each epoch when shuffling, moving
+        // runs of -B consecutive samples together so gathers stay local
         //
-        for (int i = 0; i < num_train; ++i) {
-            if (has_signal) {
-                menu();
-            }
-            network.set_label(train_data.next_label());
-            network.set_image(train_data.next_image());
-            network.forwardpass();
+        if (shuffle_seed > 0) {
+            order = mnist::permutation(num_train, mnist::mix(shuffle_seed) + epoch,
+                                       shuffle_block);
+        } else {
+            order.resize(num_train);
+            std::iota(order.begin(), order.end(), 0);
+        }
+        // edits to num_train from the menu apply from the next epoch
+        const int epoch_size = order.size();
+
+    #ifdef _OPENMP
+        if (overlap) {
+            omp_set_num_threads(evaluation.joinable() ? train_threads : threads);
+        }
+    #endif
 
-            if (real_batch_size == 1) {
+        // hogwild reads samples straight from the dataset, unaugmented
+        if (hogwild && real_batch_size == 1) {
+            network.set_batch_size(nn::max_threads());
+            for (int i = 0; i < epoch_size; i += HOGWILD_CHUNK) {
+                if (has_signal) {
+                    menu();
+                }
+                network.hogwildpass(train_data, &order[i], 
+                                    std::min(HOGWILD_CHUNK, epoch_size - i),
+                                    eta, weight_decay);
+            }
+        } else if (prefetch) {
+            prefetch->start(order.data(), epoch_size, real_batch_size, 
+                            mnist::mix(shuffle_seed) + epoch);
+            size_t rows;
+            while (Dataset *batch = prefetch->next(rows)) {
+                if (has_signal) {
+                    menu();
+                }
+                if (rows != network.batch_size()) {
+                    network.set_batch_size(rows);
+                }
+                network.load(*batch, 0);
+                network.forwardpass();
                 network.backwardpass(eta, alpha, weight_decay);
-            } else {
-                network.batch_backwardpass();
-                if (++batch_idx == real_batch_size) {
-                    network.batch_update_reset(eta, alpha, weight_decay);
-                    batch_idx = 0;
+                prefetch->release();
+            }
+            if (verbose) {
+                std::cout << "waited on loaders: " << prefetch->stall_time() << "s\n";
+            }
+        } else {
+            for (int i = 0; i < epoch_size; i += real_batch_size) {
+                if (has_signal) {
+                    menu();
                 }
+                int rows = std::min(real_batch_size, epoch_size - i);
+                if (rows != network.batch_size()) {
+                    network.set_batch_size(rows);
+                }
+                if (shuffle_seed > 0) {
+                    network.gather(train_data, &order[i]);
+                } else {
+                    network.load(train_data, i);
+                }
+                network.forwardpass();
+                network.backwardpass(eta, alpha, weight_decay);
             }
         }
 
         //
-        // test
-        // 
-        int error_count = 0;
-        
-        for (int i = 0; i < num_test; ++i) {
-            if (has_signal) {
-                menu();
+        // test - in the background on a copy of the weights when overlapping,
+        // so the next epoch can start straight away
+        //
+        if (overlap) {
+            join_evaluation();
+            snapshot->copyweights(network);
+            // the settings are taken now, as menu() may change them while
+            // the test runs
+            const int tests = num_test;
+            const bool quantize = quantized;
+            if (quantize) {
+                calibrate(*snapshot, train_data);
             }
-            auto label = test_data.next_label();
-            network.set_label(label);
-            network.set_image(test_data.next_image());
-            network.forwardpass();
-            if (label != network.get_output()) {
-                ++error_count;
+            // a new thread starts from OpenMP's default thread count, so it
+            // is handed its share of -j
+            evaluation = std::thread([&snapshot, &test_data, &report, epoch, tests, 
+                                      quantize] {
+            #ifdef _OPENMP
+                omp_set_num_threads(EVAL_THREADS);
+            #endif
+                test(*snapshot, test_data, epoch, tests, quantize, false, report);
+            });
+        } else {
+            if (quantized) {
+                calibrate(network, train_data);
             }
+            test(network, test_data, epoch, num_test, quantized, true, std::cout);
         }
+    }
+
+    join_evaluation();
+}
 
-        error_rate = (double) error_count / num_test;
 
-        std::cout << "epoch: " << std::setw(8) << (epoch+1) << ", "
-                  << "error rate: " << error_rate
-                  << "\n";
+// quantize the network's weights and calibrate its int8 activation ranges
+// on the start of the training set
+void calibrate(Network &network, Dataset &data) {
+    network.quantize();
+    for (int i = 0; i < std::min(CALIBRATION_SIZE, num_train); i += TEST_BATCH_SIZE) {
+        int rows = std::min(TEST_BATCH_SIZE, std::min(CALIBRATION_SIZE, num_train) - i);
+        if (rows != network.batch_size()) {
+            network.set_batch_size(rows);
+        }
+        network.load(data, i);
+        network.calibrate();
+    }
+}
+
 
-        train_data.reset();
-        test_data.reset();
+// run the first `tests` samples of the test set and report the result for
+// the epoch to out
+void test(Network &network, Dataset &data, const int epoch, 
+          const int tests, const bool quantize, const bool interactive,
+          std::ostream &out) {
+    // log loss only means something for a softmax output
+    const bool softmax = std::is_same<output_activation, nn::Softmax>::value;
+    int error_count = 0;
+    double loss = 0;
+    
+    for (int i = 0; i < tests; i += TEST_BATCH_SIZE) {
+        if (interactive && has_signal) {
+            menu();
+        }
+        int rows = std::min(TEST_BATCH_SIZE, tests - i);
+        if (rows != network.batch_size()) {
+            network.set_batch_size(rows);
+        }
+        network.load(data, i);
+        if (quantize) {
+            network.quantizedpass();
+        } else {
+            network.forwardpass();
+        }
+        if (softmax) {
+            loss += network.loss();
+        }
+        for (int r = 0; r < rows; ++r) {
+            if (data.labels[i + r] != network.get_output(r)) {
+                ++error_count;
+            }
+        }
     }
 
+    double error_rate = (double) error_count / tests;
+
+    out << "epoch: " << std::setw(8) << (epoch+1) << ", "
+        << "error rate: " << error_rate;
+    if (softmax) {
+        out << ", log loss: " << loss / tests;
+    }
+    out << "\n";
 }
 
 
@@ -184,7 +398,17 @@ void menu() {
               << "    batch_flux_amount: (-F)   " << batch_flux_amount << "\n"
               << "    batch_size_decay: (-d)    " << batch_size_decay << "\n"
               << "    num_epochs: (-E)          " << num_epochs << "\n"
-              << "    threads:                  " << Eigen::nbThreads() << "\n";
+              << "    threads: (-j)             " << nn::max_threads() << "\n"
+              << "    loaders: (-l)             " << num_loaders << "\n"
+              << "    shuffle seed: (-s)        " << shuffle_seed << "\n"
+              << "    shuffle block: (-B)       " << shuffle_block << "\n"
+              << "    augment shift: (-S)       " << augment.shift << "\n"
+              << "    augment rotation: (-R)    " << augment.rotation << "\n"
+              << "    augment elastic: (-D)     " << augment.elastic << "\n"
+              << "    augment noise: (-N)       " << augment.noise << "\n"
+              << "    hogwild: (-H)             " << hogwild << "\n"
+              << "    int8 test: (-q)           " << quantized << "\n"
+              << "    overlap test: (-o)        " << overlap << "\n";
 
     char option = '?';
 menu_select:
@@ -197,7 +421,7 @@ menu_select:
             std::cin >> option;
             switch (option) {
                     case_input_value('e', eta, eta > 0 && eta <= 1);
-                    case_input_value('a', alpha, alpha >= 0 && alpha <= 1);
+                    case_input_value('a', alpha, alpha >= 0 && alpha <= 1 && !(hogwild && alpha > 0));
                     case_input_value('w', weight_decay, weight_decay >= 0);
                     case_input_value('t', num_train, num_train >= 0 && num_train <= MAX_TRAIN_SIZE);
                     case_input_value('n', num_test, num_test >= 0 && num_test <= MAX_TEST_SIZE);
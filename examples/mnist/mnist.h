@@ -2,63 +2,442 @@
 #define mnist_h
 
 #include <string>
-#include <fstream>
 #include <stdexcept>
 #include <iostream>
+#include <cstdint>
+#include <vector>
+#include <utility>
+#include <numeric>
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 namespace mnist {
 
     using byte = unsigned char;
 
+    // splitmix64 finalizer, used as a stateless hash of seed and index
+    inline uint64_t mix(uint64_t x) {
+        x += 0x9e3779b97f4a7c15ull;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    // a random permutation of [0, n) that depends only on the seed, not on
+    // the number of threads building it. with block > 1 the samples move in
+    // runs of `block` consecutive ones - the runs come in random order and
+    // are shuffled inside, so on-disk reads stay local
+    inline std::vector<size_t> permutation(const size_t n, const uint64_t seed,
+                                           const size_t block = 1) {
+        // sort key per sample: its run's, then its own
+        std::vector<std::pair<uint64_t, uint64_t>> keys(n);
+        #pragma omp parallel for
+        for (long i = 0; i < (long)n; ++i) {
+            keys[i] = {mix(seed ^ mix(i / block)), mix(~seed ^ mix(i))};
+        }
+
+        // bucket on the top bits of the key so the buckets sort in parallel
+        const int BUCKETS = 256;
+        std::vector<size_t> start(BUCKETS + 1, 0);
+        for (size_t i = 0; i < n; ++i) {
+            ++start[(keys[i].first >> 56) + 1];
+        }
+        std::partial_sum(start.begin(), start.end(), start.begin());
+
+        std::vector<size_t> order(n);
+        std::vector<size_t> end(start.begin(), start.end() - 1);
+        for (size_t i = 0; i < n; ++i) {
+            order[end[keys[i].first >> 56]++] = i;
+        }
+
+        #pragma omp parallel for schedule(dynamic)
+        for (int b = 0; b < BUCKETS; ++b) {
+            std::sort(order.begin() + start[b], order.begin() + start[b+1],
+                      [&](const size_t x, const size_t y) { 
+                          return keys[x] < keys[y]; 
+                      });
+        }
+        return order;
+    }
+
+    // a file mapped read-only, a window at a time so files larger than
+    // memory can be streamed: with the sequential hint only the current
+    // window is mapped, and the kernel is asked to read the next one ahead
+    // while it is consumed. with the random hint the whole file is mapped
+    // at once instead, where the address space allows, so reads anywhere in
+    // it cost no further syscalls
+    class Mapping {
+    public:
+        // expected access pattern, passed on to the kernel
+        enum access { sequential = MADV_SEQUENTIAL, random = MADV_RANDOM };
+
+        Mapping(const std::string &file, const size_t window = 16 << 20):
+                file(file),
+                pattern(sequential),
+                data(nullptr) {
+            fd = ::open(file.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error("unable to open " + file);
+            }
+            struct stat st;
+            if (::fstat(fd, &st) != 0) {
+                ::close(fd);
+                throw std::runtime_error("unable to stat " + file);
+            }
+            length = st.st_size;
+
+            // whole pages, enough for an element straddling two
+            const size_t page = ::sysconf(_SC_PAGESIZE);
+            this->window = (std::max(window, 2 * page) + page - 1) / page * page;
+        }
+
+        Mapping(const Mapping&) = delete;
+        Mapping &operator=(const Mapping&) = delete;
+
+        ~Mapping() {
+            unmap();
+            ::close(fd);
+        }
+
+        // length of the file in bytes
+        size_t size() const {
+            return length;
+        }
+
+        // pointer to the byte at pos, with at least n bytes mapped from
+        // there on - the window grows for a run longer than it. the pointer
+        // stays valid until the next map() or advise() call
+        const byte *map(const size_t pos, const size_t n) {
+            if (data && pos >= begin && pos + n <= end) {
+                return data + (pos - begin);
+            }
+            unmap();
+            if (pattern == random && map_range(0, length)) {
+                return data + pos;
+            }
+            const size_t page = ::sysconf(_SC_PAGESIZE);
+            const size_t first = pos / page * page;
+            if (!map_range(first, std::min(std::max(first + window, pos + n), length))) {
+                throw std::runtime_error("unable to map " + file);
+            }
+            if (pattern == sequential && end < length) {
+                ::posix_fadvise(fd, end, window, POSIX_FADV_WILLNEED);
+            }
+            return data + (pos - begin);
+        }
+
+        // bytes mapped from pos on, for a pos the last map() covered
+        size_t mapped(const size_t pos) const {
+            return end - pos;
+        }
+
+        // n bytes from pos copied into out, without mapping them
+        void read(byte *out, const size_t n, const size_t pos) const {
+            if (::pread(fd, out, n, pos) != (ssize_t)n) {
+                throw std::runtime_error("unable to read " + file);
+            }
+        }
+
+        // hint how the file will be read - random turns off read-ahead and
+        // maps the whole file on the next map()
+        void advise(const access pattern) {
+            this->pattern = pattern;
+            if (data && pattern == random && end - begin < length) {
+                unmap();
+            }
+            if (data) {
+                ::madvise(const_cast<byte*>(data), end - begin, pattern);
+            }
+        }
+
+    private:
+        // map bytes [first, last) of the file, first on a page boundary -
+        // false if the address space has no room for them
+        bool map_range(const size_t first, const size_t last) {
+            void *p = ::mmap(nullptr, last - first, PROT_READ, MAP_PRIVATE, fd, first);
+            if (p == MAP_FAILED) {
+                return false;
+            }
+            data = static_cast<const byte*>(p);
+            begin = first;
+            end = last;
+            ::madvise(p, last - first, pattern);
+            return true;
+        }
+
+        void unmap() {
+            if (data) {
+                ::munmap(const_cast<byte*>(data), end - begin);
+                data = nullptr;
+            }
+        }
+
+        std::string file;
+        int fd;
+        size_t length;
+        size_t window;
+        access pattern;
+
+        const byte *data;
+        size_t begin;
+        size_t end;
+    };
+
+
+    // any IDX file, read through a Mapping. samples come converted to the
+    // caller's type from read() and next(), or in place in the file's own
+    // layout from samples()
+    class IDX {
+    public:
+        enum type { u8 = 0x08, i8 = 0x09, i16 = 0x0b, i32 = 0x0c, f32 = 0x0d, f64 = 0x0e };
+
+        IDX(const std::string &file, const size_t window = 16 << 20):
+                file(file),
+                data(file, window),
+                cursor(0) {
+            // magic is two zero bytes, the element type and the rank
+            byte magic[4];
+            if (data.size() < 4) {
+                throw std::runtime_error("bad IDX header in " + file);
+            }
+            data.read(magic, 4, 0);
+            if (magic[0] != 0 || magic[1] != 0 || magic[3] == 0) {
+                throw std::runtime_error("bad IDX header in " + file);
+            }
+            dtype_ = type(magic[2]);
+            switch (dtype_) {
+                case u8: case i8: element_size_ = 1; break;
+                case i16: element_size_ = 2; break;
+                case i32: case f32: element_size_ = 4; break;
+                case f64: element_size_ = 8; break;
+                default:
+                    throw std::runtime_error("unknown IDX type in " + file);
+            }
+
+            std::vector<byte> dims(4 * magic[3]);
+            offset = 4 + dims.size();
+            if (data.size() < offset) {
+                throw std::runtime_error("bad IDX header in " + file);
+            }
+            data.read(dims.data(), dims.size(), 4);
+            sample_size_ = 1;
+            for (int d = 0; d < magic[3]; ++d) {
+                shape_.push_back(decode<uint32_t>(&dims[4 * d]));
+                if (d > 0) {
+                    sample_size_ *= shape_[d];
+                }
+            }
+            if (data.size() < offset + size() * sample_size_ * element_size_) {
+                throw std::runtime_error("truncated " + file);
+            }
+        }
+
+        type dtype() const {
+            return dtype_;
+        }
+
+        // dimensions, the first one counting samples
+        const std::vector<size_t> &shape() const {
+            return shape_;
+        }
+
+        // number of samples
+        size_t size() const {
+            return shape_[0];
+        }
+
+        // elements per sample
+        size_t sample_size() const {
+            return sample_size_;
+        }
+
+        // samples [first, first + n) converted from the file's type to T
+        template<class T>
+        void read(const size_t first, const size_t n, T *out) {
+            if (first + n > size()) {
+                throw std::out_of_range("reading past the end of " + file);
+            }
+            size_t pos = offset + first * sample_size_ * element_size_;
+            const size_t total = n * sample_size_;
+            for (size_t done = 0; done < total; ) {
+                const byte *p = data.map(pos, element_size_);
+                const size_t count = std::min(total - done, 
+                        data.mapped(pos) / element_size_);
+                convert(p, count, out + done);
+                done += count;
+                pos += count * element_size_;
+            }
+        }
+
+        // up to n samples from where the last next() stopped, returning how
+        // many were read - 0 at the end of the file
+        template<class T>
+        size_t next(const size_t n, T *out) {
+            const size_t count = std::min(n, size() - cursor);
+            read(cursor, count, out);
+            cursor += count;
+            return count;
+        }
+
+        // samples [first, first + n) in place, in the file's big-endian
+        // layout - for u8 and i8 that is just the values. the pointer stays
+        // valid until the next read(), next(), samples() or advise() call
+        const byte *samples(const size_t first, const size_t n) {
+            if (first + n > size()) {
+                throw std::out_of_range("reading past the end of " + file);
+            }
+            const size_t bytes = sample_size_ * element_size_;
+            return data.map(offset + first * bytes, n * bytes);
+        }
+
+        const byte *sample(const size_t i) {
+            return samples(i, 1);
+        }
+
+        // hint how the file will be read - see Mapping
+        void advise(const Mapping::access pattern) {
+            data.advise(pattern);
+        }
+
+        void seek(const size_t sample) {
+            cursor = std::min(sample, size());
+        }
+
+        // sample the next next() starts at
+        size_t tell() const {
+            return cursor;
+        }
+
+    private:
+        // big-endian value of type S at p
+        template<class S>
+        static S decode(const byte *p) {
+            typename std::conditional<sizeof(S) == 8, uint64_t, uint32_t>::type bits = 0;
+            for (size_t b = 0; b < sizeof(S); ++b) {
+                bits = bits << 8 | p[b];
+            }
+            S value;
+            if (std::is_floating_point<S>::value) {
+                std::memcpy(&value, &bits, sizeof(S));
+            } else {
+                value = S(bits);
+            }
+            return value;
+        }
+
+        template<class T>
+        void convert(const byte *p, const size_t n, T *out) const {
+            switch (dtype_) {
+                case u8: _convert<uint8_t>(p, n, out); break;
+                case i8: _convert<int8_t>(p, n, out); break;
+                case i16: _convert<int16_t>(p, n, out); break;
+                case i32: _convert<int32_t>(p, n, out); break;
+                case f32: _convert<float>(p, n, out); break;
+                case f64: _convert<double>(p, n, out); break;
+            }
+        }
+
+        template<class S, class T>
+        static void _convert(const byte *p, const size_t n, T *out) {
+            for (size_t i = 0; i < n; ++i) {
+                out[i] = static_cast<T>(decode<S>(p + i * sizeof(S)));
+            }
+        }
+
+        std::string file;
+        Mapping data;
+        size_t offset;
+
+        type dtype_;
+        size_t element_size_;
+        std::vector<size_t> shape_;
+        size_t sample_size_;
+
+        size_t cursor;
+    };
+
+
+    // labels and images read in place from a pair of IDX files of unsigned
+    // bytes, one label per image - the pointers from image(), images() and
+    // next_image() point into the mapped file, and stay valid until the
+    // next read from the DB
     class DB {
     public:
-        DB(const std::string &label_file, const std::string &image_file):
+        DB(const std::string &label_file, const std::string &image_file,
+           const size_t image_size = 28*28):
                 labels(label_file),
-                images(image_file) {
-            if (!labels.is_open()) {
-                throw std::runtime_error("unable to open " + label_file);
+                images_(image_file) {
+            if (labels.dtype() != IDX::u8 || labels.sample_size() != 1) {
+                throw std::runtime_error("bad label header in " + label_file);
             }
-
-            if (!images.is_open()) {
-                throw std::runtime_error("unable to open " + label_file);
+            if (images_.dtype() != IDX::u8 || images_.sample_size() != image_size) {
+                throw std::runtime_error("bad image header in " + image_file);
+            }
+            if (images_.size() != labels.size()) {
+                throw std::runtime_error(label_file + " and " + image_file +
+                                         " hold different numbers of samples");
             }
 
+            advise(Mapping::sequential);
             reset();
         }
 
+        // number of samples
+        size_t size() const {
+            return labels.size();
+        }
+
+        byte label(const size_t i) {
+            return *labels.sample(i);
+        }
+
+        const byte *image(const size_t i) {
+            return images_.sample(i);
+        }
+
+        // images [first, first + n), one after another
+        const byte *images(const size_t first, const size_t n) {
+            return images_.samples(first, n);
+        }
+
         byte next_label() {
-            labels.read((char*)&label, LBL_SIZE);
-            if (!labels) {
+            if (next_lbl == size()) {
                 throw std::runtime_error("unable to read label");
             }
-            return label;
+            return label(next_lbl++);
         }
 
-        byte *next_image() {
-            images.read((char*)&image, IMG_SIZE);
-            if (!images) {
-                throw std::runtime_error("unable to read label");
+        const byte *next_image() {
+            if (next_img == size()) {
+                throw std::runtime_error("unable to read image");
             }
-            return image;
+            return image(next_img++);
         }
 
         void reset() {
-            labels.seekg(LBL_HEADER_SIZE, labels.beg);
-            images.seekg(IMG_HEADER_SIZE, images.beg);
+            next_lbl = 0;
+            next_img = 0;
         }
 
-    private:
-        static constexpr size_t LBL_HEADER_SIZE    = 8;
-        static constexpr size_t IMG_HEADER_SIZE    = 16;
-        static constexpr size_t LBL_SIZE           = 1;
-        static constexpr size_t IMG_SIZE           = 28*28;
+        // hint the expected access pattern to the kernel
+        void advise(const Mapping::access pattern) {
+            labels.advise(pattern);
+            images_.advise(pattern);
+        }
 
-        byte label;
-        byte image[IMG_SIZE];
+    private:
+        IDX labels;
+        IDX images_;
 
-        std::ifstream labels;
-        std::ifstream images;
+        size_t next_lbl;
+        size_t next_img;
     };
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -1,49 +1,200 @@
 #ifndef _network_h
 #define _network_h
 
+#include <stdexcept>
+#include <string>
+#include <vector>
+
 #include "mnist.h"
 #include "nn.h"
 
+// scalar type used for training and inference - build with 
+// `make SCALAR=float` for single precision
+#ifndef MNIST_SCALAR
+#define MNIST_SCALAR double
+#endif
+
+typedef MNIST_SCALAR scalar;
+
+// hidden layer activation policy - build with e.g. `make ACTIVATION=ReLU`
+#ifndef MNIST_ACTIVATION
+#define MNIST_ACTIVATION Sigmoid
+#endif
+
+typedef nn::MNIST_ACTIVATION activation;
+
+// output layer activation policy - `make OUTPUT=Softmax` trains against
+// cross-entropy instead of squared error
+#ifndef MNIST_OUTPUT
+#define MNIST_OUTPUT Sigmoid
+#endif
+
+typedef nn::MNIST_OUTPUT output_activation;
+
+// optimizer policy - build with e.g. `make OPTIMIZER='Adam<>'`. the
+// adaptive optimizers want a much smaller learning rate, e.g. -e 0.001
+#ifndef MNIST_OPTIMIZER
+#define MNIST_OPTIMIZER Momentum
+#endif
+
+typedef nn::MNIST_OPTIMIZER optimizer;
+
+// type the forward and backward passes read the weights in - build with
+// e.g. `make SCALAR=float WEIGHTS=nn::bfloat16` or WEIGHTS=Eigen::half.
+// updates still go to a master copy in the scalar type
+#ifndef MNIST_WEIGHTS
+#define MNIST_WEIGHTS scalar
+#endif
+
+typedef MNIST_WEIGHTS weights;
+
+
+// input value for a pixel
+inline scalar pixel(const mnist::byte value) {
+    return ::pow((scalar)value / 0xff, 3);
+}
+
+
+// a whole dataset preprocessed once into one contiguous block, with a row
+// per sample in the form the input layer takes
+struct Dataset {
+    nn::matrix<scalar, Eigen::Dynamic, 784> X;
+    std::vector<mnist::byte> labels;
+
+    // images are converted a chunk at a time straight out of the mapped
+    // file, so only one window of raw pixels is mapped besides the result
+    Dataset(const std::string &label_file, const std::string &image_file) {
+        const size_t CHUNK = 4096;
+        mnist::DB db(label_file, image_file);
+
+        labels.resize(db.size());
+        for (size_t k = 0; k < db.size(); ++k) {
+            labels[k] = db.label(k);
+        }
+
+        scalar table[256];
+        for (int v = 0; v < 256; ++v) {
+            table[v] = pixel(v);
+        }
+
+        X.resize(db.size(), 784);
+        for (size_t first = 0; first < db.size(); first += CHUNK) {
+            const size_t rows = std::min(CHUNK, db.size() - first);
+            const mnist::byte *chunk = db.images(first, rows);
+            #pragma omp parallel for
+            for (long r = 0; r < (long)rows; ++r) {
+                for (int i = 0; i < 784; ++i) {
+                    X(first + r, i) = table[chunk[r * 784 + i]];
+                }
+            }
+        }
+    }
+
+    // room for `rows` samples, to be filled in by hand
+    Dataset(const size_t rows): X(rows, 784), labels(rows) {}
+
+    size_t size() const {
+        return labels.size();
+    }
+};
+
 class Network {
 
 public:
     Network():
-        ih(nn::connect(input,h1)),
-        hh(nn::connect(h1,h2)),
-        ho(nn::connect(h2,output))
+        ih(nn::connect<optimizer, weights>(input,h1)),
+        hh(nn::connect<optimizer, weights>(h1,h2)),
+        ho(nn::connect<optimizer, weights>(h2,output)),
+        qih(input,h1),
+        qhh(h1,h2),
+        qho(h2,output)
     {}
 
-    void set_image(const mnist::byte *image) {
-        for (int i = 0; i < 784; ++i) {
-            input.Z(0,i) = ::pow((double)image[i] / 0xff, 3);
-        }
+    void set_batch_size(const size_t rows) {
+        nn::set_batch_size(rows, input, h1, h2, output);
     }
 
-    void set_label(const mnist::byte label) {
-        output.Y.setZero();
-        output.Y(0,label) = 1;
+    size_t batch_size() const {
+        return output.batch_size();
     }
 
-    mnist::byte get_output() {
-        double max = 0;
-        mnist::byte result;
-        for (int i = 0; i < 10; ++i) {
-            if (output.Z(0,i) > max) {
-                result = i;
-                max = output.Z(0,i);
-            }
+    // use the samples from `first` on in place as the current minibatch
+    void load(Dataset &data, const size_t first) {
+        if (first + batch_size() > data.size()) {
+            throw std::out_of_range("minibatch past the end of the dataset");
         }
+        input.view(data.X.row(first).data(), batch_size());
+        for (size_t r = 0; r < batch_size(); ++r) {
+            set_label(r, data.labels[first + r]);
+        }
+    }
+
+    // copy the samples order[0], order[1], ... into the input layer's own
+    // buffer as the current minibatch
+    void gather(Dataset &data, const size_t *order) {
+        input.view(input.X.data(), batch_size());
+        for (size_t r = 0; r < batch_size(); ++r) {
+            input.Z.row(r) = data.X.row(order[r]);
+            set_label(r, data.labels[order[r]]);
+        }
+    }
+
+    void set_label(const size_t row, const mnist::byte label) {
+        output.Y.row(row).setZero();
+        output.Y(row,label) = 1;
+    }
+
+    // index of the largest output, whatever range the activation has
+    mnist::byte get_output(const size_t row) {
+        Eigen::Index result;
+        output.Z.row(row).maxCoeff(&result);
         return result;
     }
 
+    // cross-entropy summed over the current minibatch
+    scalar loss() const {
+        return nn::log_loss(output);
+    }
+
     void forwardpass() {
+        nn::no_malloc guard;
         nn::forwardstep(ih);
         nn::forwardstep(hh);
         nn::forwardstep(ho);
     }
 
+    // copy the weights and biases of another network, e.g. to test them
+    // while this one keeps training
+    void copyweights(const Network &from) {
+        nn::copyweights(ih, from.ih);
+        nn::copyweights(hh, from.hh);
+        nn::copyweights(ho, from.ho);
+    }
+
+    // int8 forward pass - needs quantize() and calibrate() first
+    void quantizedpass() {
+        nn::forwardstep(qih);
+        nn::forwardstep(qhh);
+        nn::forwardstep(qho);
+    }
+
+    // take an int8 copy of the current weights
+    void quantize() {
+        nn::quantize(qih, ih);
+        nn::quantize(qhh, hh);
+        nn::quantize(qho, ho);
+    }
+
+    // run a full precision forward pass over the current images and fit
+    // the int8 input ranges to it
+    void calibrate() {
+        forwardpass();
+        nn::calibrate(qih, qhh, qho);
+    }
+
     void backwardpass(const double eta, const double alpha, 
                       const double weight_decay) {
+        nn::no_malloc guard;
         nn::calc_output_delta(output);
         nn::backwardstep(ho);
         nn::backwardstep(hh);
@@ -51,27 +202,55 @@ public:
         nn::updateweights(eta, alpha, weight_factor, ih, hh, ho);
     }
 
-    void batch_backwardpass() {
-        nn::calc_output_delta(output);
-        nn::batch_backwardstep(ho);
-        nn::batch_backwardstep(hh);            
-    }
+    // train on the `samples` images order[0], order[1], ... with one sample
+    // per thread at a time, every thread updating the shared weights without
+    // locks. needs one row per thread, from set_batch_size(nn::max_threads()).
+    // steps are plain SGD - momentum and the optimizer policy are not used.
+    // weight decay is applied once for the whole run of samples, as the
+    // per-sample factor raised to `samples`, rather than between the steps,
+    // so it only matches serial training to first order in eta * decay
+    void hogwildpass(Dataset &data, const size_t *order, const int samples, 
+                     const double eta, const double weight_decay) {
+        nn::no_malloc guard;
+        int next = 0;
 
-    void batch_update_reset(const double eta, const double alpha, 
-                            const double weight_decay) {
-        double weight_factor = 1.0 - eta * weight_decay;
-        nn::updateweights(eta, alpha, weight_factor, ih, hh, ho);
-        nn::batch_reset_gradients(hh, ho);
+        #pragma omp parallel num_threads(batch_size())
+        {
+            const size_t row = nn::thread_id();
+            for (;;) {
+                int k;
+                #pragma omp atomic capture
+                k = next++;
+                if (k >= samples) {
+                    break;
+                }
+                input.Z.row(row) = data.X.row(order[k]);
+                set_label(row, data.labels[order[k]]);
+                nn::forwardsample(row, ih);
+                nn::forwardsample(row, hh);
+                nn::forwardsample(row, ho);
+                nn::calc_output_delta(row, output);
+                nn::backwardsample(row, ho);
+                nn::backwardsample(row, hh);
+                nn::updatesample(row, eta, ih, hh, ho);
+            }
+        }
+
+        nn::decayweights(std::pow(1.0 - eta * weight_decay, samples), 
+                         ih, hh, ho);
     }
 
 private:
-    nn::InputLayer<784> input;
-    nn::HiddenLayer<200> h1;
-    nn::HiddenLayer<100> h2;
-    nn::OutputLayer<10> output;
-    decltype(nn::connect(input,h1)) ih;
-    decltype(nn::connect(h1,h2)) hh;
-    decltype(nn::connect(h2,output)) ho;
+    nn::SparseInputLayer<784, scalar> input;
+    nn::HiddenLayer<200, scalar, activation> h1;
+    nn::HiddenLayer<100, scalar, activation> h2;
+    nn::OutputLayer<10, scalar, output_activation> output;
+    decltype(nn::connect<optimizer, weights>(input,h1)) ih;
+    decltype(nn::connect<optimizer, weights>(h1,h2)) hh;
+    decltype(nn::connect<optimizer, weights>(h2,output)) ho;
+    nn::QuantizedConnection<decltype(input), decltype(h1)> qih;
+    nn::QuantizedConnection<decltype(h1), decltype(h2)> qhh;
+    nn::QuantizedConnection<decltype(h2), decltype(output)> qho;
 };
 
 #endif
\ No newline at end of file
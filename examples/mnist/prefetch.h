@@ -0,0 +1,187 @@
+#ifndef _prefetch_h
+#define _prefetch_h
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "augment.h"
+#include "network.h"
+
+// minibatches packed ahead of training by loader threads into a ring of
+// buffers, so the training thread only waits when the loaders fall behind.
+// buffers are allocated once and reused for every batch. with an augmenter
+// the loaders also distort every sample on its way into the buffer
+class Prefetcher {
+public:
+    Prefetcher(Dataset &data, const int loaders, const Augmenter *augment = nullptr):
+            data(data),
+            loaders(loaders),
+            augment(augment),
+            // one slot per loader plus the one being trained on
+            slots(loaders + 1),
+            stopping(false),
+            stalled(0) {}
+
+    Prefetcher(const Prefetcher&) = delete;
+    Prefetcher &operator=(const Prefetcher&) = delete;
+
+    // loaders may be waiting for turns that never come if the epoch was
+    // abandoned, e.g. by an exception, so they are told to stop first
+    ~Prefetcher() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        freed.notify_all();
+        finish();
+    }
+
+    // start packing the `samples` samples order[0], order[1], ... in
+    // batches of `rows`, distorted as the key picks. order must stay valid
+    // for the epoch
+    void start(const size_t *order, const size_t samples, const size_t rows,
+               const uint64_t key = 0) {
+        finish();
+        if (!slots[0] || slots[0]->batch.size() < rows) {
+            for (auto &slot : slots) {
+                slot.reset(new Slot(rows));
+            }
+        }
+        epoch_order = order;
+        epoch_key = key;
+        epoch_samples = samples;
+        batch_rows = rows;
+        batches = (samples + batch_rows - 1) / batch_rows;
+        next_fill = 0;
+        next_use = 0;
+        stalled = stalled.zero();
+        for (size_t s = 0; s < slots.size(); ++s) {
+            slots[s]->turn = s;
+            slots[s]->ready = false;
+        }
+        for (int t = 0; t < loaders; ++t) {
+            threads.emplace_back(&Prefetcher::load, this);
+        }
+    }
+
+    // the next packed batch of the epoch, or nullptr at its end. the
+    // batch stays valid until release()
+    Dataset *next(size_t &rows) {
+        if (next_use == batches) {
+            finish();
+            return nullptr;
+        }
+        Slot &slot = *slots[next_use % slots.size()];
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!slot.ready) {
+            const auto begin = std::chrono::steady_clock::now();
+            filled.wait(lock, [&] { return slot.ready; });
+            stalled += std::chrono::steady_clock::now() - begin;
+        }
+        rows = slot.rows;
+        return &slot.batch;
+    }
+
+    // hand the batch from next() back to the loaders
+    void release() {
+        Slot &slot = *slots[next_use % slots.size()];
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            slot.ready = false;
+            slot.turn += slots.size();
+        }
+        ++next_use;
+        freed.notify_all();
+    }
+
+    // time the training thread has waited on the loaders this epoch
+    double stall_time() const {
+        return stalled.count();
+    }
+
+private:
+    struct Slot {
+        Slot(const size_t rows): batch(rows) {}
+        Dataset batch;
+        size_t rows;
+        // index of the batch this slot holds next
+        size_t turn;
+        bool ready;
+    };
+
+    void load() {
+        for (;;) {
+            size_t k;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                k = next_fill++;
+            }
+            if (k >= batches) {
+                return;
+            }
+
+            Slot &slot = *slots[k % slots.size()];
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                freed.wait(lock, [&] { return slot.turn == k || stopping; });
+                if (stopping) {
+                    return;
+                }
+            }
+
+            const size_t *order = epoch_order + k * batch_rows;
+            slot.rows = std::min(batch_rows, epoch_samples - k * batch_rows);
+            for (size_t r = 0; r < slot.rows; ++r) {
+                if (augment) {
+                    augment->apply(data.X.row(order[r]).data(), 
+                                   slot.batch.X.row(r).data(),
+                                   mnist::mix(epoch_key ^ mnist::mix(order[r])));
+                } else {
+                    slot.batch.X.row(r) = data.X.row(order[r]);
+                }
+                slot.batch.labels[r] = data.labels[order[r]];
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                slot.ready = true;
+            }
+            filled.notify_one();
+        }
+    }
+
+    void finish() {
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        threads.clear();
+    }
+
+    Dataset &data;
+    const int loaders;
+    const Augmenter *augment;
+    std::vector<std::unique_ptr<Slot>> slots;
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable filled;
+    std::condition_variable freed;
+    bool stopping;
+
+    const size_t *epoch_order;
+    uint64_t epoch_key;
+    size_t epoch_samples;
+    size_t batch_rows;
+    size_t batches;
+    size_t next_fill;
+    size_t next_use;
+
+    std::chrono::duration<double> stalled;
+};
+
+#endif
@@ -1,14 +1,358 @@
 #ifndef nn_h
 #define nn_h
 
+#include <algorithm>
+#include <limits>
 #include <random>
+#include <ratio>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
 
 #include "Eigen/Dense"
 
 namespace nn {
 
 
+    //
+    // storage policy:
+    //      the contiguous (inner) dimension of every buffer is fixed at
+    //      compile time. the outer dimension is fixed as well when the whole
+    //      block fits in NN_MAX_FIXED_BYTES, otherwise it falls back to
+    //      aligned heap storage. Eigen::Dynamic marks the minibatch dimension
+    //
+    #ifndef NN_MAX_FIXED_BYTES
+    #define NN_MAX_FIXED_BYTES 16384
+    #endif
+
+    template<class Scalar, int Rows, int Cols>
+    struct storage {
+        static constexpr bool row_major =
+                Rows == 1 || (Cols != 1 && Cols != Eigen::Dynamic);
+        static constexpr bool large =
+                Rows != Eigen::Dynamic && Cols != Eigen::Dynamic &&
+                Rows * Cols * sizeof(Scalar) > NN_MAX_FIXED_BYTES;
+
+        typedef Eigen::Matrix<Scalar,
+                              large &&  row_major ? Eigen::Dynamic : Rows,
+                              large && !row_major ? Eigen::Dynamic : Cols,
+                              row_major ? Eigen::RowMajor : Eigen::ColMajor> type;
+    };
+
+    template<class Scalar, int Rows, int Cols>
+    using matrix = typename storage<Scalar, Rows, Cols>::type;
+
+
+    // rows processed together by the fused kernels - a tile of activations or
+    // weights stays in cache between the product and the element-wise work
+    // that follows it
+    #ifndef NN_TILE_ROWS
+    #define NN_TILE_ROWS 64
+    #endif
+
+
+    // number of threads the kernels split a step across - each thread works
+    // on its own range of samples, or its own band of rows of W
+    inline int max_threads() {
+    #ifdef _OPENMP
+        return omp_get_max_threads();
+    #else
+        return 1;
+    #endif
+    }
+
+
+    // index of the calling thread within a parallel region
+    inline int thread_id() {
+    #ifdef _OPENMP
+        return omp_get_thread_num();
+    #else
+        return 0;
+    #endif
+    }
+
+
+    //
+    // activation policies for hidden and output layers:
+    //      Sigmoid
+    //      Tanh
+    //      ReLU
+    //      LeakyReLU<Slope>    (Slope is a std::ratio in [0, 1), e.g. std::ratio<1,100>)
+    //      Identity
+    //      Softmax             (output layers only, trained with cross-entropy)
+    //
+    struct Sigmoid;
+    struct Tanh;
+    struct ReLU;
+    template<class Slope> struct LeakyReLU;
+    struct Identity;
+    struct Softmax;
+
+
+    //
+    // optimizer policies for updateweights:
+    //      Momentum                        (eta, alpha)
+    //      AdaGrad<Epsilon>                (eta)
+    //      RMSProp<Decay, Epsilon>         (eta)
+    //      Adam<Beta1, Beta2, Epsilon>     (eta)
+    // the constants are std::ratios with the usual defaults. alpha is only
+    // used by Momentum
+    //
+    typedef std::ratio<1, 100000000> default_epsilon;
+
+    struct Momentum;
+    template<class Epsilon = default_epsilon> 
+    struct AdaGrad;
+    template<class Decay = std::ratio<9,10>, class Epsilon = default_epsilon> 
+    struct RMSProp;
+    template<class Beta1 = std::ratio<9,10>, class Beta2 = std::ratio<999,1000>,
+             class Epsilon = default_epsilon> 
+    struct Adam;
+
+
+    // bfloat16 - the upper half of an IEEE float. it keeps the float's
+    // exponent range, so weights need no loss scaling to stay representable
+    struct bfloat16 {
+        uint16_t bits;
+
+        bfloat16() = default;
+
+        // round to nearest even, keeping NaNs quiet
+        explicit bfloat16(const float x) {
+            uint32_t u;
+            std::memcpy(&u, &x, sizeof u);
+            bits = std::isnan(x) ? (u >> 16) | 0x40 
+                                 : (u + 0x7fff + ((u >> 16) & 1)) >> 16;
+        }
+
+        explicit operator float() const {
+            const uint32_t u = uint32_t(bits) << 16;
+            float x;
+            std::memcpy(&x, &u, sizeof x);
+            return x;
+        }
+
+        explicit operator double() const {
+            return float(*this);
+        }
+    };
+
+
+    // 8 weights of a compact storage type loaded as floats, and stored back
+    // from them, for the types the ISA converts with a few instructions
+    template<class Storage>
+    struct packet {
+        static constexpr bool native = false;
+    };
+
+
+    #ifdef __AVX2__
+    template<>
+    struct packet<bfloat16> {
+        static constexpr bool native = true;
+
+        static inline __m256 load(const bfloat16 *p) {
+            const __m128i x = _mm_loadu_si128((const __m128i *)p);
+            return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(x), 16));
+        }
+
+        // round to nearest even, keeping NaNs quiet, as bfloat16(float) does.
+        // the AVX512 instruction also flushes denormals, as -Ofast would
+        static inline void store(bfloat16 *p, const __m256 x) {
+        #if defined(__AVX512BF16__) && defined(__AVX512VL__)
+            _mm_storeu_si128((__m128i *)p, (__m128i)_mm256_cvtneps_pbh(x));
+        #else
+            const __m256i u = _mm256_castps_si256(x);
+            const __m256i odd = _mm256_and_si256(_mm256_srli_epi32(u, 16), 
+                                                 _mm256_set1_epi32(1));
+            const __m256i rounded = _mm256_srli_epi32(_mm256_add_epi32(
+                    u, _mm256_add_epi32(odd, _mm256_set1_epi32(0x7fff))), 16);
+            const __m256i quiet = _mm256_or_si256(_mm256_srli_epi32(u, 16),
+                                                  _mm256_set1_epi32(0x40));
+            const __m256i bits = _mm256_blendv_epi8(rounded, quiet, 
+                    _mm256_castps_si256(_mm256_cmp_ps(x, x, _CMP_UNORD_Q)));
+            // packus works within 128 bit lanes, so put the halves together
+            const __m256i packed = _mm256_permute4x64_epi64(
+                    _mm256_packus_epi32(bits, bits), _MM_SHUFFLE(3,1,2,0));
+            _mm_storeu_si128((__m128i *)p, _mm256_castsi256_si128(packed));
+        #endif
+        }
+    };
+    #endif
+
+
+    #ifdef __F16C__
+    template<>
+    struct packet<Eigen::half> {
+        static constexpr bool native = true;
+
+        static inline __m256 load(const Eigen::half *p) {
+            return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)p));
+        }
+
+        static inline void store(Eigen::half *p, const __m256 x) {
+            _mm_storeu_si128((__m128i *)p, _mm256_cvtps_ph(x, _MM_FROUND_TO_NEAREST_INT));
+        }
+    };
+    #endif
+
+
+    // dst[j] = src[j] for j in [0, n), between the layer scalar and a
+    // compact storage type, whole packets at a time where there are any
+    template<class To, class From>
+    inline void convert(To *dst, const From *src, const size_t n) {
+        size_t j = 0;
+    #ifdef __AVX__
+        if constexpr (std::is_same<To, float>::value && packet<From>::native) {
+            for (const size_t m = n / 8 * 8; j < m; j += 8) {
+                _mm256_storeu_ps(dst + j, packet<From>::load(src + j));
+            }
+        } else if constexpr (std::is_same<From, float>::value && packet<To>::native) {
+            for (const size_t m = n / 8 * 8; j < m; j += 8) {
+                packet<To>::store(dst + j, _mm256_loadu_ps(src + j));
+            }
+        }
+    #endif
+        for (; j < n; ++j) {
+            dst[j] = To(float(src[j]));
+        }
+    }
+
+
+    // compact copy of the weights for storage types narrower than the
+    // layers' scalar - forwardstep and backwardstep read C, widening rows
+    // of it inside the sums for a single sample and a tile of rows at a time
+    // into P for a minibatch, while updates go to the master W and are
+    // copied into C as each row is finished
+    template<class Scalar, class Storage, int Rows, int Cols>
+    struct WeightStorage {
+        typedef std::true_type compact;
+
+        static constexpr int rows = Rows < NN_TILE_ROWS ? Rows : NN_TILE_ROWS;
+
+        // compact weights
+        matrix<Storage, Rows, Cols> C;
+
+        // threads P has a tile for, fixed when the connection is made
+        const int panel_threads;
+
+        // widened weights - one tile of rows per thread
+        matrix<Scalar, Eigen::Dynamic, Cols> P;
+
+        WeightStorage(): 
+                panel_threads(max_threads()),
+                P(matrix<Scalar, Eigen::Dynamic, Cols>::Zero(rows * panel_threads, Cols)) {
+            C.resize(Rows, Cols);
+        }
+
+        // copy rows of the master weights into C - both are whole rows, so
+        // this is one flat run
+        template<class W>
+        void store(const W &master, const int row, const int n) {
+            convert(C.row(row).data(), master.row(row).data(), size_t(n) * Cols);
+        }
+    };
+
+
+    template<class Scalar, int Rows, int Cols>
+    struct WeightStorage<Scalar, Scalar, Rows, Cols> {
+        typedef std::false_type compact;
+
+        static constexpr int panel_threads = std::numeric_limits<int>::max();
+
+        template<class W>
+        void store(const W &, const int, const int) {}
+    };
+
+
+    // per-parameter optimizer state for a Rows x Cols block of parameters,
+    // laid out like the block itself so an update walks all of them in step.
+    // the adaptive optimizers also keep a tile of gradient scratch
+    template<class Optimizer, class Scalar, int Rows, int Cols>
+    struct OptimizerState;
+
+
+    template<class Scalar, int Rows, int Cols>
+    struct OptimizerState<Momentum, Scalar, Rows, Cols> {
+
+        static constexpr int tile_threads = std::numeric_limits<int>::max();
+
+        // momentum
+        matrix<Scalar, Rows, Cols> M;
+
+        OptimizerState(): M(matrix<Scalar, Rows, Cols>::Zero(Rows, Cols)) {}
+    };
+
+
+    template<class Scalar, int Rows, int Cols>
+    struct OptimizerTile {
+        static constexpr int rows = Rows < NN_TILE_ROWS ? Rows : NN_TILE_ROWS;
+
+        // threads G has a tile for, fixed when the state is made
+        const int tile_threads;
+
+        // gradient scratch - one tile of rows per thread
+        matrix<Scalar, Eigen::Dynamic, Cols> G;
+
+        OptimizerTile(): 
+                tile_threads(max_threads()),
+                G(matrix<Scalar, Eigen::Dynamic, Cols>::Zero(rows * tile_threads, Cols)) {}
+    };
+
+
+    template<class Epsilon, class Scalar, int Rows, int Cols>
+    struct OptimizerState<AdaGrad<Epsilon>, Scalar, Rows, Cols>:
+            OptimizerTile<Scalar, Rows, Cols> {
+
+        // sum of squared gradients
+        matrix<Scalar, Rows, Cols> V;
+
+        OptimizerState(): V(matrix<Scalar, Rows, Cols>::Zero(Rows, Cols)) {}
+    };
+
+
+    template<class Decay, class Epsilon, class Scalar, int Rows, int Cols>
+    struct OptimizerState<RMSProp<Decay, Epsilon>, Scalar, Rows, Cols>:
+            OptimizerTile<Scalar, Rows, Cols> {
+
+        // running mean of squared gradients
+        matrix<Scalar, Rows, Cols> V;
+
+        OptimizerState(): V(matrix<Scalar, Rows, Cols>::Zero(Rows, Cols)) {}
+    };
+
+
+    template<class Beta1, class Beta2, class Epsilon, 
+             class Scalar, int Rows, int Cols>
+    struct OptimizerState<Adam<Beta1, Beta2, Epsilon>, Scalar, Rows, Cols>:
+            OptimizerTile<Scalar, Rows, Cols> {
+
+        // running means of gradients and squared gradients
+        matrix<Scalar, Rows, Cols> M;
+        matrix<Scalar, Rows, Cols> V;
+
+        // Beta1^t and Beta2^t for the bias correction
+        Scalar B1;
+        Scalar B2;
+
+        OptimizerState(): 
+                M(matrix<Scalar, Rows, Cols>::Zero(Rows, Cols)),
+                V(matrix<Scalar, Rows, Cols>::Zero(Rows, Cols)),
+                B1(1), B2(1) {}
+    };
+
+
     //
     // 3 layer types:
     //      Input
@@ -16,72 +360,149 @@ namespace nn {
     //      Output
     //
 
-    template<size_t N>
+    template<size_t N, class T = double>
     struct LayerBase {
 
-        // activations
-        Eigen::MatrixXd Z;
+        typedef T Scalar;
+
+        // activations - one row per sample in the current minibatch
+        matrix<Scalar, Eigen::Dynamic, N> Z;
 
-        LayerBase(Eigen::MatrixXd Z): Z(Z) {}
+        LayerBase(matrix<Scalar, Eigen::Dynamic, N> Z): Z(Z) {}
+
+        // number of samples in the current minibatch
+        size_t batch_size() const { return Z.rows(); }
 
         static constexpr size_t size = N;
     };
 
 
-    template<size_t N>
-    struct InputLayer: LayerBase<N> {
-        InputLayer(): LayerBase<N>(Eigen::MatrixXd::Zero(1,N)) {}
+    // an input layer's activations are read through Z, which maps the
+    // layer's own buffer X by default. view() points it at rows of another
+    // matrix instead, e.g. a preprocessed dataset, so a minibatch can be
+    // used where it lies without copying it in
+    template<size_t N, class T = double>
+    struct InputLayer {
+
+        typedef T Scalar;
+
+        // activations written in place - one row per sample
+        matrix<Scalar, Eigen::Dynamic, N> X;
+
+        // activations - one row per sample in the current minibatch
+        Eigen::Map<matrix<Scalar, Eigen::Dynamic, N>> Z;
+
+        InputLayer(): 
+                X(matrix<Scalar, Eigen::Dynamic, N>::Zero(1,N)),
+                Z(X.data(), 1, N) {}
+
+        // use `rows` samples laid out like Z, starting at data
+        void view(Scalar *data, const size_t rows) {
+            new (&Z) Eigen::Map<matrix<Scalar, Eigen::Dynamic, N>>(data, rows, N);
+        }
+
+        // number of samples in the current minibatch
+        size_t batch_size() const { return Z.rows(); }
+
+        static constexpr size_t size = N;
     };
 
 
-    template<size_t N>
-    struct Layer: public LayerBase<N> {
+    // input layer for mostly-zero inputs - forwardstep only visits the rows
+    // of W that belong to nonzero inputs, and updateweights with Momentum or
+    // AdaGrad only touches the rows of W and their optimizer state whose
+    // inputs were nonzero somewhere in the minibatch. either falls back to
+    // the dense kernels once more than NN_SPARSE_DENSITY of what it would
+    // scan is nonzero. RMSProp and Adam change every row on every step, so
+    // they always update it like a dense input layer
+    template<size_t N, class Scalar = double>
+    struct SparseInputLayer: InputLayer<N, Scalar> {
 
-        // biases
-        Eigen::MatrixXd B;
+        // scratch list of nonzero input columns
+        std::vector<int> active;
 
-        // gradients
-        Eigen::MatrixXd D;
+        SparseInputLayer(): InputLayer<N, Scalar>() {
+            active.reserve(N);
+        }
+    };
 
-        // bias momentum
-        Eigen::MatrixXd M;
 
-        // previous bias deltas
-        // Eigen::MatrixXd M;
+    template<size_t N, class Scalar = double, class Activation = Sigmoid>
+    struct Layer: public LayerBase<N, Scalar> {
 
-        Layer(): LayerBase<N>(Eigen::MatrixXd::Random(1,N) * 0.1),
-                B(Eigen::MatrixXd::Random(1,N) * 0.1),
-                D(Eigen::MatrixXd(N,1)),
-                M(Eigen::MatrixXd::Zero(1,N)) {
+        typedef Activation activation;
+
+        // biases
+        matrix<Scalar, 1, N> B;
+
+        // gradients - one column per sample in the current minibatch
+        matrix<Scalar, N, Eigen::Dynamic> D;
+
+        Layer(): LayerBase<N, Scalar>(matrix<Scalar, Eigen::Dynamic, N>::Random(1,N) * Scalar(0.1)),
+                B(matrix<Scalar, 1, N>::Random(1,N) * Scalar(0.1)),
+                D(matrix<Scalar, N, Eigen::Dynamic>::Zero(N,1)) {
 
             for (int i = 0; i < N; ++i) {
-                LayerBase<N>::Z(0,i) += 0.5;
+                LayerBase<N, Scalar>::Z(0,i) += Scalar(0.5);
             }
         }
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
     };
 
 
-    template<size_t N>
-    struct HiddenLayer: public Layer<N> {
-        HiddenLayer(): Layer<N>() {}
+    template<size_t N, class Scalar = double, class Activation = Sigmoid>
+    struct HiddenLayer: public Layer<N, Scalar, Activation> {
+        HiddenLayer(): Layer<N, Scalar, Activation>() {}
     };
 
 
-    template<size_t N>
-    struct OutputLayer: public Layer<N> {
+    template<size_t N, class Scalar = double, class Activation = Sigmoid>
+    struct OutputLayer: public Layer<N, Scalar, Activation> {
 
-        // expected values
-        Eigen::MatrixXd Y;
+        // expected values - one row per sample in the current minibatch
+        matrix<Scalar, Eigen::Dynamic, N> Y;
 
         OutputLayer(): 
-                Layer<N>(),
-                Y(Eigen::MatrixXd::Zero(1,N)) {}
+                Layer<N, Scalar, Activation>(),
+                Y(matrix<Scalar, Eigen::Dynamic, N>::Zero(1,N)) {}
 
     };
 
 
-    template<class A, class B>
-    struct Connection {
+    // connection state that only some lower layer types need
+    template<class A>
+    struct ConnectionState {};
+
+
+    template<size_t N, class Scalar>
+    struct ConnectionState<SparseInputLayer<N, Scalar>> {
+
+        // rows of M that may hold nonzero momentum, ascending
+        std::vector<int> R;
+
+        ConnectionState() {
+            R.reserve(N);
+        }
+    };
+
+
+    // the connection carries the optimizer state for W directly, and for the
+    // upper layer's biases in bias. Storage is the type the forward and
+    // backward kernels read the weights in, e.g. float, bfloat16 or
+    // Eigen::half; W itself always holds Scalar
+    template<class A, class B, class Optimizer = Momentum, 
+             class Storage = typename A::Scalar>
+    struct Connection: 
+            public ConnectionState<A>,
+            public OptimizerState<Optimizer, typename A::Scalar, A::size, B::size>,
+            public WeightStorage<typename A::Scalar, Storage, A::size, B::size> {
+        typedef typename A::Scalar Scalar;
+        typedef Optimizer optimizer;
+        typedef Storage storage;
+
+        static_assert(std::is_same<Scalar, typename B::Scalar>::value,
+                      "connected layers must have the same scalar type");
 
         // lower layer
         A &lower;
@@ -90,74 +511,211 @@ namespace nn {
         B &upper;
 
         // weight matrix
-        Eigen::MatrixXd W;
-        
-        // weight momentum
-        Eigen::MatrixXd M;
+        matrix<Scalar, A::size, B::size> W;
 
-        // HACK - buffer for temporary storage of delta calculations for batch
-        Eigen::MatrixXd tmp;
+        // weight scale - the effective weights are scale * W, so weight
+        // decay only has to touch this scalar
+        Scalar scale;
+
+        // optimizer state for the upper layer's biases
+        OptimizerState<Optimizer, Scalar, 1, B::size> bias;
+
+        // threads the kernels may split work on this connection across -
+        // the caller's setting, but no more than P and G have tiles for
+        int threads() const {
+            return std::min({max_threads(), this->panel_threads, this->tile_threads});
+        }
 
         Connection(A &lower, B &upper): 
                 lower(lower), 
                 upper(upper), 
-                W(Eigen::MatrixXd(A::size, B::size) * 0.1),
-                M(Eigen::MatrixXd::Zero(A::size, B::size)),
-                tmp(Eigen::MatrixXd::Zero(A::size, 1)) {
+                W(matrix<Scalar, A::size, B::size>::Zero(A::size, B::size)),
+                scale(1) {
 
             // initialize weights with mean 0 and standard deviation 1/sqrt(|A|)
             std::default_random_engine rng;
-            std::normal_distribution<double> dist(0, 1.0 / std::sqrt(A::size));      
+            std::normal_distribution<Scalar> dist(0, 1.0 / std::sqrt(A::size));      
             for (int i = 0; i < A::size; ++i) {
                 for (int j = 0; j < B::size; ++j) {
                     W(i,j) = dist(rng);
                 }
             }     
+            this->store(W, 0, A::size);
         }
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
     };
 
-    // connect two layers
+
+    //
+    // int8 inference copy of a trained connection: weights are quantized
+    // per upper unit into [-127, 127], and the lower layer's activations
+    // into [0, 127] with a scale and zero point calibrated from sample data,
+    // so the pairwise 16 bit sums of the u8 x s8 dot product never
+    // saturate. forwardstep on it reads lower.Z and writes upper.Z like the
+    // full precision connection does
+    //
     template<class A, class B>
-    Connection<A,B> connect(A &lower, B &upper) {
-        return Connection<A,B>(lower, upper);
+    struct QuantizedConnection {
+        typedef typename A::Scalar Scalar;
+
+        // inputs padded to whole 32 byte blocks
+        static constexpr int K = (A::size + 31) / 32 * 32;
+
+        // lower layer
+        A &lower;
+
+        // upper layer
+        B &upper;
+
+        // quantized weights - one row per upper unit
+        matrix<int8_t, B::size, K> Q;
+
+        // row sums of Q, to take out the input zero point
+        matrix<int32_t, 1, B::size> R;
+
+        // weight scale per upper unit
+        matrix<float, 1, B::size> S;
+
+        // quantized inputs - one row per sample in the current minibatch
+        matrix<uint8_t, Eigen::Dynamic, K> X;
+
+        // calibrated range of the inputs
+        Scalar low;
+        Scalar high;
+
+        // an input z is stored as round(z / step) + zero
+        float step;
+        int zero;
+
+        QuantizedConnection(A &lower, B &upper):
+                lower(lower),
+                upper(upper),
+                Q(matrix<int8_t, B::size, K>::Zero(B::size, K)),
+                R(matrix<int32_t, 1, B::size>::Zero(1, B::size)),
+                S(matrix<float, 1, B::size>::Ones(1, B::size)),
+                X(matrix<uint8_t, Eigen::Dynamic, K>::Zero(1, K)),
+                low(0), high(1), step(1.0f / 127), zero(0) {}
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+
+
+    //
+    // debug hook - when built with EIGEN_RUNTIME_NO_MALLOC, Eigen asserts on
+    // any heap allocation made while a no_malloc guard is alive. use it
+    // around training steps after the first one to check that the steady
+    // state runs entirely out of preallocated buffers. without the define
+    // the guard does nothing. the flag it sets is process-wide, so another
+    // thread allocating meanwhile trips it too - don't check while a second
+    // thread does Eigen work, e.g. the mnist example's -o
+    //
+    struct no_malloc {
+    #ifdef EIGEN_RUNTIME_NO_MALLOC
+        const bool allowed;
+
+        no_malloc(): allowed(Eigen::internal::is_malloc_allowed()) {
+            Eigen::internal::set_is_malloc_allowed(false);
+        }
+
+        ~no_malloc() {
+            Eigen::internal::set_is_malloc_allowed(allowed);
+        }
+    #else
+        // user-provided, so guards don't warn as unused variables
+        no_malloc() {}
+    #endif
+    };
+
+
+    // connect two layers, e.g. connect(a, b), connect<Adam<>>(a, b) or
+    // connect<Momentum, bfloat16>(a, b)
+    template<class Optimizer = Momentum, class Storage = void, class A, class B>
+    Connection<A, B, Optimizer, 
+               typename std::conditional<std::is_void<Storage>::value, 
+                                         typename A::Scalar, Storage>::type> 
+    connect(A &lower, B &upper) {
+        return {lower, upper};
     }
 
-    // compute a forward pass from one layer to another
-    template<class A, class B, class ...C>
-    void forwardstep(Connection<A,B> &first, C&... args);
+    // set the number of samples held by each layer's activation block
+    template<class... L>
+    void set_batch_size(const size_t rows, L&... layers);
+
+    // compute a forward pass from one layer to another for every sample in
+    // the minibatch
+    template<class A, class B, class O, class S, class ...C>
+    void forwardstep(Connection<A,B,O,S> &first, C&... args);
 
     // calculate the output delta to begin propagating gradients downward
-    template<size_t N>
-    void calc_output_delta(Layer<N> &out);
+    template<size_t N, class Scalar, class F>
+    void calc_output_delta(OutputLayer<N, Scalar, F> &out);
 
-    // for minibatch training - reset the current output delta
-    template<size_t N>
-    void batch_reset_output_delta(Layer<N> &out);
+    // compute a backward pass from one layer to another
+    template<class A, class B, class O, class S, class... C>
+    void backwardstep(Connection<A,B,O,S> &first, C&... connections);
 
-    // for minibatch training - add a Y vector to the current output delta
-    template<size_t N>
-    void batch_add_output_delta(Layer<N> &out);
+    // update weights for connections based on gradients summed over the
+    // minibatch, using each connection's optimizer policy
+    template<class... C>
+    void updateweights(const double eta, const double alpha, 
+                       const double weight_factor,  C&... connections);
+
+    //
+    // hogwild training - several threads train on one sample each, sample
+    // being the thread's own row of the activation blocks, and update the
+    // shared weights without locks. the per-sample steps are plain SGD
+    // whatever the connections' optimizer, and weight decay is left to a
+    // decayweights call once the threads have joined
+    //
+    template<class A, class B, class O, class S, class ...C>
+    void forwardsample(const size_t sample, Connection<A,B,O,S> &first, C&... args);
+
+    template<size_t N, class Scalar, class F>
+    void calc_output_delta(const size_t sample, OutputLayer<N, Scalar, F> &out);
+
+    template<class A, class B, class O, class S, class... C>
+    void backwardsample(const size_t sample, Connection<A,B,O,S> &first, 
+                        C&... connections);
 
-    // compute a backward pass from one layer to another
-    template<class A, class B, class... C>
-    void backwardstep(Connection<A,B> &first, C&... connections);
-    
-    // for minibatch training - zero out all gradients 
     template<class... C>
-    void batch_reset_gradients(C&... connections);
+    void updatesample(const size_t sample, const double eta, C&... connections);
 
-      // for minibatch training - add to gradients
-    template<class A, class B, class... C>
-    void batch_backwardstep(Connection<A,B> &first, C&... connections);
+    // apply weight decay on its own
+    template<class... C>
+    void decayweights(const double weight_factor, C&... connections);
+
+    // copy the weights of one connection, and the biases of its upper layer,
+    // into another of the same type
+    template<class A, class B, class O, class S>
+    void copyweights(Connection<A,B,O,S> &to, const Connection<A,B,O,S> &from);
 
-    // update weights for connections based on gradients
+    // fold the weight scale back into W, so W holds the effective weights
     template<class... C>
-    void updateweights(const double eta, const double alpha, 
-                       const double weight_factor,  C&... connections);
+    void renormalize(C&... connections);
+
+    // quantize the effective weights of a trained connection into q, and
+    // restart its calibration from the range [0, 1]
+    template<class A, class B, class O, class S>
+    void quantize(QuantizedConnection<A,B> &q, const Connection<A,B,O,S> &connection);
+
+    // widen the calibrated input ranges to cover the current activations of
+    // each connection's lower layer - call after full precision forward
+    // passes over sample data
+    template<class... Q>
+    void calibrate(Q&... connections);
+
+    // compute an int8 forward pass from one layer to another
+    template<class A, class B, class... Q>
+    void forwardstep(QuantizedConnection<A,B> &first, Q&... connections);
 
     // error amount - sum of squares
-    template<size_t N>
-    double error(const Layer<N> &out);
+    template<size_t N, class Scalar, class F>
+    Scalar error(const OutputLayer<N, Scalar, F> &out);
+
+    // error amount - cross-entropy summed over the minibatch
+    template<size_t N, class Scalar, class F>
+    Scalar log_loss(const OutputLayer<N, Scalar, F> &out);
 
 }
 
@@ -7,9 +7,29 @@
 
 #include <cmath>
 #include <iostream>
+#include <limits>
+#include <ratio>
 
 #define MAX_VECTOR_STACK 1000
 
+// weight decay shrinks Connection::scale instead of W; once the scale
+// drops below this it is folded back into W
+#ifndef NN_MIN_WEIGHT_SCALE
+#define NN_MIN_WEIGHT_SCALE 1e-4
+#endif
+
+// fewest multiply-adds a kernel needs before it is split across threads
+#ifndef NN_MIN_PARALLEL_WORK
+#define NN_MIN_PARALLEL_WORK 32768
+#endif
+
+// largest fraction of nonzero inputs for which a SparseInputLayer skips
+// the dense product, or of inputs active in the minibatch for which it
+// skips the dense weight update
+#ifndef NN_SPARSE_DENSITY
+#define NN_SPARSE_DENSITY 0.25
+#endif
+
 namespace nn {
 
 
@@ -17,118 +37,958 @@ namespace nn {
     inline void pass(_&&...) {}
 
 
-    inline double sigmoid(double x) {
-        return x < -45 ? 0 :
-               x >  45 ? 1 :
-               1.0 / (1.0 + std::exp(-x));
+    // call f(begin, end, thread) on one contiguous slice of [0, n) per
+    // thread, using at most `threads` threads. small jobs run on the
+    // calling thread as f(0, n, 0)
+    template<class F>
+    static inline void _parallel(const size_t n, const size_t work, F &&f,
+                                 const int threads = max_threads()) {
+    #ifdef _OPENMP
+        if (n > 1 && threads > 1 && work >= NN_MIN_PARALLEL_WORK) {
+            #pragma omp parallel num_threads(threads)
+            {
+                const size_t t = omp_get_thread_num();
+                const size_t T = omp_get_num_threads();
+                f(n * t / T, n * (t + 1) / T, t);
+            }
+            return;
+        }
+    #endif
+        f(0, n, 0);
     }
 
 
-    inline double dsigmoid(double x) {
-        return (1.0 - x) * x;
+
+    // also points Z back at the layer's own buffer
+    template<size_t N, class Scalar>
+    int _set_batch_size(const size_t rows, InputLayer<N, Scalar> &layer) {
+        layer.X.resize(rows, N);
+        layer.view(layer.X.data(), rows);
+        return 0;
     }
 
+    template<size_t N, class Scalar, class F>
+    int _set_batch_size(const size_t rows, Layer<N, Scalar, F> &layer) {
+        layer.Z.resize(rows, N);
+        layer.D.resize(N, rows);
+        return 0;
+    }
 
+    template<size_t N, class Scalar, class F>
+    int _set_batch_size(const size_t rows, OutputLayer<N, Scalar, F> &layer) {
+        _set_batch_size(rows, static_cast<Layer<N, Scalar, F>&>(layer));
+        layer.Y.setZero(rows, N);
+        return 0;
+    }
 
+    template<class... L>
+    void set_batch_size(const size_t rows, L&... layers) {
+        pass( _set_batch_size(rows, layers)... );
+    }
 
-    template<class A, class B>
-    inline static auto _forwardstep(Connection<A,B> &connection) {
-        return connection.lower.Z * connection.W;
+
+    template<class Scalar>
+    inline Scalar sigmoid(Scalar x) {
+        return x < -45 ? Scalar(0) :
+               x >  45 ? Scalar(1) :
+               Scalar(1) / (Scalar(1) + std::exp(-x));
     }
 
 
-    template<class A, class B, class... C>
-    inline static auto _forwardstep(Connection<A,B> &connection, C&... connections) {
-        return _forwardstep(connection) + _forwardstep(connections...);
+    template<class Scalar>
+    inline Scalar dsigmoid(Scalar x) {
+        return (Scalar(1) - x) * x;
     }
 
 
-    template<class A, class B, class... C>
-    void forwardstep(Connection<A,B> &first, C&... connections) {
-        first.upper.Z = first.upper.B + _forwardstep(first, connections...);
-        for (int i = 0; i < B::size; ++i) {
-            first.upper.Z(0, i) = sigmoid(first.upper.Z(0, i));
+    //
+    // vectorized activation kernels, applied through Eigen's unaryExpr so
+    // the packet path is used for whole SIMD registers and the scalar
+    // functions above only handle the tail.
+    //
+    // sigmoid_op clamps to [-45, 45] and evaluates 1 / (1 + exp(-x)) with
+    // Eigen's packet exp (range reduction to |r| <= ln(2)/2, then a degree 5
+    // polynomial for float or a Pade approximant for double). max absolute
+    // error against the exact logistic function over the clamped range is
+    // 2.2e-7 for float and 1.7e-16 for double, i.e. within 2 ulp of 1.
+    //
+    template<class Scalar>
+    struct sigmoid_op {
+        inline Scalar operator()(const Scalar &x) const {
+            return sigmoid(x);
+        }
+
+        template<class Packet>
+        inline Packet packetOp(const Packet &x) const {
+            using namespace Eigen::internal;
+            const Packet one = pset1<Packet>(Scalar(1));
+            const Packet lo  = pset1<Packet>(Scalar(-45));
+            const Packet hi  = pset1<Packet>(Scalar(45));
+            return pdiv(one, padd(one, pexp(pnegate(pmin(pmax(x, lo), hi)))));
         }
+    };
+
+
+    template<class Scalar>
+    struct dsigmoid_op {
+        inline Scalar operator()(const Scalar &x) const {
+            return dsigmoid(x);
+        }
+
+        template<class Packet>
+        inline Packet packetOp(const Packet &x) const {
+            using namespace Eigen::internal;
+            return pmul(psub(pset1<Packet>(Scalar(1)), x), x);
+        }
+    };
+
+
+    // tanh(x) = 2 * sigmoid(2x) - 1 on the packet path, so it shares the
+    // packet exp; max absolute error is twice that of sigmoid_op
+    template<class Scalar>
+    struct tanh_op {
+        inline Scalar operator()(const Scalar &x) const {
+            return std::tanh(x);
+        }
+
+        template<class Packet>
+        inline Packet packetOp(const Packet &x) const {
+            using namespace Eigen::internal;
+            const Packet two = pset1<Packet>(Scalar(2));
+            return psub(pmul(two, sigmoid_op<Scalar>().packetOp(pmul(two, x))),
+                        pset1<Packet>(Scalar(1)));
+        }
+    };
+
+
+    template<class Scalar>
+    struct dtanh_op {
+        inline Scalar operator()(const Scalar &x) const {
+            return Scalar(1) - x * x;
+        }
+
+        template<class Packet>
+        inline Packet packetOp(const Packet &x) const {
+            using namespace Eigen::internal;
+            return psub(pset1<Packet>(Scalar(1)), pmul(x, x));
+        }
+    };
+
+
+    // max(x, slope * x) for slopes in [0, 1)
+    template<class Scalar, class Slope>
+    struct relu_op {
+        inline Scalar operator()(const Scalar &x) const {
+            return x > 0 ? x : x * slope();
+        }
+
+        template<class Packet>
+        inline Packet packetOp(const Packet &x) const {
+            using namespace Eigen::internal;
+            return Slope::num == 0 ? pmax(x, pset1<Packet>(Scalar(0))) 
+                                   : pmax(x, pmul(x, pset1<Packet>(slope())));
+        }
+
+        static constexpr Scalar slope() {
+            return Scalar(Slope::num) / Scalar(Slope::den);
+        }
+    };
+
+
+    // 1 for positive activations, slope otherwise. the packet path has no
+    // compare in this version of Eigen, so the step is formed as
+    // clamp(x * highest, 0, 1), which is exact for every normal x
+    template<class Scalar, class Slope>
+    struct drelu_op {
+        inline Scalar operator()(const Scalar &x) const {
+            return x > 0 ? Scalar(1) : relu_op<Scalar, Slope>::slope();
+        }
+
+        template<class Packet>
+        inline Packet packetOp(const Packet &x) const {
+            using namespace Eigen::internal;
+            const Scalar slope = relu_op<Scalar, Slope>::slope();
+            const Packet step = pmax(pmin(
+                    pmul(x, pset1<Packet>(Eigen::NumTraits<Scalar>::highest())),
+                    pset1<Packet>(Scalar(1))), pset1<Packet>(Scalar(0)));
+            return Slope::num == 0 ? step
+                                   : padd(pset1<Packet>(slope), 
+                                          pmul(step, pset1<Packet>(1 - slope)));
+        }
+    };
+
+
+    //
+    // activation policies. forward applies the activation to a tile of
+    // activations in place, backward multiplies a tile of deltas by the
+    // derivative expressed in terms of the activations, and derivative is
+    // the scalar version of the same for the single-sample path
+    //
+    template<class Policy>
+    struct Elementwise {
+
+        template<class Tile>
+        static inline void forward(Tile &&tile) {
+            typedef typename std::decay<Tile>::type::Scalar Scalar;
+            tile = tile.unaryExpr(typename Policy::template op<Scalar>());
+        }
+
+        template<class Tile, class Z>
+        static inline void backward(Tile &&tile, const Z &z) {
+            typedef typename std::decay<Tile>::type::Scalar Scalar;
+            tile.array() *= z.array().unaryExpr(
+                    typename Policy::template dop<Scalar>());
+        }
+
+        template<class Scalar>
+        static inline Scalar derivative(const Scalar z) {
+            return typename Policy::template dop<Scalar>()(z);
+        }
+    };
+
+
+    struct Sigmoid: Elementwise<Sigmoid> {
+        template<class Scalar> using op  = sigmoid_op<Scalar>;
+        template<class Scalar> using dop = dsigmoid_op<Scalar>;
+    };
+
+
+    struct Tanh: Elementwise<Tanh> {
+        template<class Scalar> using op  = tanh_op<Scalar>;
+        template<class Scalar> using dop = dtanh_op<Scalar>;
+    };
+
+
+    template<class Slope>
+    struct LeakyReLU: Elementwise<LeakyReLU<Slope>> {
+        static_assert(Slope::num >= 0 && Slope::num < Slope::den,
+                      "LeakyReLU slope must be in [0, 1)");
+
+        template<class Scalar> using op  = relu_op<Scalar, Slope>;
+        template<class Scalar> using dop = drelu_op<Scalar, Slope>;
+    };
+
+
+    struct ReLU: LeakyReLU<std::ratio<0>> {};
+
+
+    // softmax across each sample - only valid on an output layer, where the
+    // Z - Y delta from calc_output_delta is the exact cross-entropy gradient.
+    // each row is shifted by its max before the exp so it cannot overflow,
+    // and the exp, sum and normalization run while the row is in cache
+    struct Softmax {
+
+        template<class Tile>
+        static inline void forward(Tile &&tile) {
+            for (int r = 0; r < tile.rows(); ++r) {
+                auto z = tile.row(r).array();
+                z = (z - z.maxCoeff()).exp();
+                z /= z.sum();
+            }
+        }
+
+        template<class Tile, class Z>
+        static inline void backward(Tile &&, const Z &) {
+            static_assert(sizeof(Tile) == 0, 
+                          "Softmax is only supported on output layers");
+        }
+
+        template<class Scalar>
+        static inline Scalar derivative(const Scalar) {
+            static_assert(sizeof(Scalar) == 0, 
+                          "Softmax is only supported on output layers");
+            return Scalar(1);
+        }
+    };
+
+
+    struct Identity {
+
+        template<class Tile>
+        static inline void forward(Tile &&) {}
+
+        template<class Tile, class Z>
+        static inline void backward(Tile &&, const Z &) {}
+
+        template<class Scalar>
+        static inline Scalar derivative(const Scalar) {
+            return Scalar(1);
+        }
+    };
+
+
+
+
+    // widen rows [row, row + n) of the compact weights into the calling
+    // thread's tile of P. both are contiguous runs of whole rows, so this is
+    // one flat conversion
+    template<class A, class B, class O, class S>
+    static inline auto _widen(Connection<A,B,O,S> &connection, 
+                              const size_t row, const size_t n) {
+        typedef typename A::Scalar Scalar;
+        typedef WeightStorage<Scalar, S, A::size, B::size> storage;
+        auto P = connection.P.middleRows(thread_id() * storage::rows, n);
+        convert(P.data(), connection.C.row(row).data(), n * B::size);
+        return P;
+    }
+
+
+    // y += a * x over n elements, for a compact row x widened as it is read
+    template<class Scalar, class S>
+    static inline void _widenaxpy(Scalar *y, const Scalar a, const S *x, 
+                                  const size_t n) {
+        size_t j = 0;
+    #ifdef __AVX__
+        if constexpr (std::is_same<Scalar, float>::value && packet<S>::native) {
+            const __m256 va = _mm256_set1_ps(a);
+            for (const size_t m = n / 8 * 8; j < m; j += 8) {
+                _mm256_storeu_ps(y + j, _mm256_add_ps(_mm256_loadu_ps(y + j), 
+                        _mm256_mul_ps(va, packet<S>::load(x + j))));
+            }
+        }
+    #endif
+        for (; j < n; ++j) {
+            y[j] += a * Scalar(float(x[j]));
+        }
+    }
+
+
+    // x . y over n elements, for a compact row x widened as it is read
+    template<class Scalar, class S>
+    static inline Scalar _widendot(const S *x, const Scalar *y, const size_t n) {
+        size_t j = 0;
+        Scalar sum = 0;
+    #ifdef __AVX__
+        if constexpr (std::is_same<Scalar, float>::value && packet<S>::native) {
+            __m256 acc = _mm256_setzero_ps();
+            for (const size_t m = n / 8 * 8; j < m; j += 8) {
+                acc = _mm256_add_ps(acc, _mm256_mul_ps(packet<S>::load(x + j), 
+                                                       _mm256_loadu_ps(y + j)));
+            }
+            __m128 h = _mm_add_ps(_mm256_castps256_ps128(acc), 
+                                  _mm256_extractf128_ps(acc, 1));
+            h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+            h = _mm_add_ss(h, _mm_movehdup_ps(h));
+            sum = _mm_cvtss_f32(h);
+        }
+    #endif
+        for (; j < n; ++j) {
+            sum += Scalar(float(x[j])) * y[j];
+        }
+        return sum;
+    }
+
+
+    // y += a * row i of the weights as the kernels see them
+    template<class A, class B, class O, class S, class Y>
+    static inline void _axpyrow(Y &&y, const typename A::Scalar a,
+                                Connection<A,B,O,S> &connection, const int i,
+                                std::false_type) {
+        y += a * connection.W.row(i);
+    }
+
+
+    template<class A, class B, class O, class S, class Y>
+    static inline void _axpyrow(Y &&y, const typename A::Scalar a,
+                                Connection<A,B,O,S> &connection, const int i,
+                                std::true_type) {
+        _widenaxpy(y.data(), a, connection.C.row(i).data(), B::size);
+    }
+
+
+    // row i of the weights as the kernels see them, dotted with y
+    template<class A, class B, class O, class S, class Y>
+    static inline typename A::Scalar _dotrow(Connection<A,B,O,S> &connection, 
+                                             const int i, const Y &y,
+                                             std::false_type) {
+        return connection.W.row(i).dot(y);
+    }
+
+
+    template<class A, class B, class O, class S, class Y>
+    static inline typename A::Scalar _dotrow(Connection<A,B,O,S> &connection, 
+                                             const int i, const Y &y,
+                                             std::true_type) {
+        return _widendot(connection.C.row(i).data(), y.data(), B::size);
+    }
+
+
+    // rows [row, row + n) of the weights as the products see them
+    template<class A, class B, class O, class S>
+    static inline auto _weightrows(Connection<A,B,O,S> &connection, 
+                                   const size_t row, const size_t n,
+                                   std::false_type) {
+        return connection.W.middleRows(row, n);
+    }
+
+
+    template<class A, class B, class O, class S>
+    static inline auto _weightrows(Connection<A,B,O,S> &connection, 
+                                   const size_t row, const size_t n,
+                                   std::true_type) {
+        return _widen(connection, row, n);
+    }
+
+
+    // each sample's activations as a sum of the rows of W for its nonzero
+    // inputs, with compact rows widened inside the sum
+    template<class A, class B, class O, class S, class Tile, class Compact>
+    inline static int _forwardrows(Tile &tile, const size_t row,
+                                   Connection<A,B,O,S> &connection, 
+                                   Compact compact) {
+        typedef typename A::Scalar Scalar;
+        const auto Z = connection.lower.Z.middleRows(row, tile.rows());
+        for (int r = 0; r < Z.rows(); ++r) {
+            for (int i = 0; i < A::size; ++i) {
+                if (Z(r, i) != Scalar(0)) {
+                    _axpyrow(tile.row(r), connection.scale * Z(r, i), 
+                             connection, i, compact);
+                }
+            }
+        }
+        return 0;
+    }
+
+
+    // the products run over one tile of rows of W at a time, so only that
+    // tile of compact weights is ever held at full precision, and Eigen's
+    // packing buffers fit on the stack whatever blocking the ISA gets. a
+    // single sample has nothing to reuse a widened tile for, so it reads
+    // compact weights straight into the sum instead
+    template<class A, class B, class O, class S, class Tile, class Compact>
+    inline static int _forwardstep(Tile &tile, const size_t row,
+                                   Connection<A,B,O,S> &connection, 
+                                   Compact compact) {
+        if (Compact::value && tile.rows() == 1) {
+            return _forwardrows(tile, row, connection, compact);
+        }
+
+        const auto Z = connection.lower.Z.middleRows(row, tile.rows());
+        for (size_t k = 0; k < A::size; k += NN_TILE_ROWS) {
+            const size_t n = std::min<size_t>(NN_TILE_ROWS, A::size - k);
+            tile.noalias() += connection.scale 
+                            * Z.middleCols(k, n) 
+                            * _weightrows(connection, k, n, compact);
+        }
+        return 0;
+    }
+
+
+    template<class A, class B, class O, class S, class Tile>
+    inline static int _forwardstep(Tile &tile, const size_t row,
+                                   Connection<A,B,O,S> &connection) {
+        return _forwardstep(tile, row, connection, 
+                            typename Connection<A,B,O,S>::compact());
+    }
+
+
+    template<size_t N, class Scalar, class B, class O, class S, class Tile>
+    inline static int _forwardstep(Tile &tile, const size_t row,
+                                   Connection<SparseInputLayer<N, Scalar>, B, O, S> &connection) {
+        typedef typename Connection<SparseInputLayer<N, Scalar>, B, O, S>::compact compact;
+        auto Z = connection.lower.Z.middleRows(row, tile.rows());
+        if ((Z.array() != Scalar(0)).count() > NN_SPARSE_DENSITY * Z.size()) {
+            return _forwardstep(tile, row, connection, compact());
+        }
+        return _forwardrows(tile, row, connection, compact());
     }
 
 
+    template<class A, class B, class O, class S, class... C>
+    static inline void _forwardtile(const size_t row, const size_t rows,
+                                    Connection<A,B,O,S> &first, C&... connections) {
+        auto tile = first.upper.Z.middleRows(row, rows);
+        tile.rowwise() = first.upper.B.row(0);
+        pass( _forwardstep(tile, row, first), 
+              _forwardstep(tile, row, connections)... );
+        B::activation::forward(tile);
+    }
+
+
+    // threads a step over all of the connections may use
+    template<class... C>
+    static inline int _threads(const C&... connections) {
+        return std::min({connections.threads()...});
+    }
+
+
+    template<class A, class B, class O, class S, class... C>
+    void forwardstep(Connection<A,B,O,S> &first, C&... connections) {
+        const auto &Z = first.upper.Z;
+        _parallel(Z.rows(), Z.rows() * first.W.size(),
+                  [&](const size_t begin, const size_t end, int) {
+            for (size_t row = begin; row < end; row += NN_TILE_ROWS) {
+                _forwardtile(row, std::min<size_t>(NN_TILE_ROWS, end - row),
+                             first, connections...);
+            }
+        }, _threads(first, connections...));
+    }
+
+
+    template<class A, class B, class O, class S, class... C>
+    void forwardsample(const size_t sample, Connection<A,B,O,S> &first, 
+                       C&... connections) {
+        _forwardtile(sample, 1, first, connections...);
+    }
+
 
 
-    template<size_t N>
-    void calc_output_delta(OutputLayer<N> &out) {
+
+    template<size_t N, class Scalar, class F>
+    void calc_output_delta(OutputLayer<N, Scalar, F> &out) {
         out.D = (out.Z - out.Y).transpose();
     }
 
 
-    template<size_t N>
-    void batch_reset_output_delta(OutputLayer<N> &out) {
-        out.D.setZero();
+    template<size_t N, class Scalar, class F>
+    void calc_output_delta(const size_t sample, OutputLayer<N, Scalar, F> &out) {
+        out.D.col(sample) = (out.Z.row(sample) - out.Y.row(sample)).transpose();
     }
 
 
-    template<size_t N>
-    void batch_add_output_delta(OutputLayer<N> &out) {
-        out.D += (out.Z - out.Y).transpose();
+
+    // one tile of rows of W at a time, as for the forward products
+    template<class A, class B, class O, class S, class Tile, class Compact>
+    inline static int _backwardstep(Tile &tile, const size_t col,
+                                    Connection<A,B,O,S> &connection,
+                                    Compact compact) {
+        const auto D = connection.upper.D.middleCols(col, tile.cols());
+        for (size_t k = 0; k < A::size; k += NN_TILE_ROWS) {
+            const size_t n = std::min<size_t>(NN_TILE_ROWS, A::size - k);
+            tile.middleRows(k, n).noalias() += connection.scale 
+                                             * _weightrows(connection, k, n, compact) 
+                                             * D;
+        }
+        return 0;
     }
 
 
+    template<class A, class B, class O, class S, class Tile>
+    inline static int _backwardstep(Tile &tile, const size_t col,
+                                    Connection<A,B,O,S> &connection) {
+        return _backwardstep(tile, col, connection,
+                             typename Connection<A,B,O,S>::compact());
+    }
 
-    template<class A, class B>
-    inline static auto _backwardstep(Connection<A,B> &connection) {
-        return connection.W * connection.upper.D;
+
+    template<class A, class B, class O, class S>
+    inline static typename A::Scalar _backwardrow(const int i, const size_t sample,
+                                                  Connection<A,B,O,S> &connection) {
+        return connection.scale 
+             * _dotrow(connection, i, connection.upper.D.col(sample).transpose(),
+                       typename Connection<A,B,O,S>::compact());
     }
 
-    template<class A, class B, class... C>
-    inline static auto _backwardstep(Connection<A,B> &connection, C&... connections) {
-        return _backwardstep(connection) + _backwardstep(connections...);
+
+    template<class A, class B, class O, class S, class... C>
+    static inline void _backwardtile(const size_t col, const size_t cols,
+                                     Connection<A,B,O,S> &first, C&... connections) {
+        auto tile = first.lower.D.middleCols(col, cols);
+        tile.setZero();
+        pass( _backwardstep(tile, col, first), 
+              _backwardstep(tile, col, connections)... );
+        A::activation::backward(tile, first.lower.Z.middleRows(col, cols).transpose());
     }
 
-    template<class A, class B, class... C>
-    void backwardstep(Connection<A,B> &first, C&... connections) {
-        first.lower.D = _backwardstep(first, connections...);
-        for (int i = 0; i < A::size; ++i) {
-            first.lower.D(i, 0) *= dsigmoid(first.lower.Z(0, i));
+
+    template<class A, class B, class O, class S, class... C>
+    void backwardstep(Connection<A,B,O,S> &first, C&... connections) {
+        typedef typename A::activation activation;
+        auto &D = first.lower.D;
+        const auto &Z = first.lower.Z;
+
+        // single sample - every delta is a sum of dot products of a row of W
+        // with the upper deltas, gated before it is stored
+        if (D.cols() == 1) {
+            _parallel(A::size, first.W.size(), 
+                      [&](const size_t begin, const size_t end, int) {
+                for (size_t i = begin; i < end; ++i) {
+                    D(i, 0) = (_backwardrow(i, 0, first) + ... 
+                            +  _backwardrow(i, 0, connections)) 
+                            * activation::derivative(Z(0, i));
+                }
+            }, _threads(first, connections...));
+            return;
         }
+
+        // minibatch - accumulate every connection into a tile of samples in
+        // place, then gate it while it is still in cache
+        _parallel(D.cols(), D.cols() * first.W.size(),
+                  [&](const size_t begin, const size_t end, int) {
+            for (size_t col = begin; col < end; col += NN_TILE_ROWS) {
+                _backwardtile(col, std::min<size_t>(NN_TILE_ROWS, end - col),
+                              first, connections...);
+            }
+        }, _threads(first, connections...));
     }
 
 
+    template<class A, class B, class O, class S, class... C>
+    void backwardsample(const size_t sample, Connection<A,B,O,S> &first, 
+                        C&... connections) {
+        typedef typename A::activation activation;
+        auto &D = first.lower.D;
+        const auto &Z = first.lower.Z;
 
-    template<class A, class B>
-    int _batch_reset_gradients(Connection<A, B> &connection) {
-        connection.lower.D.setZero();
+        // one row of W at a time, as for a single-sample backwardstep - 
+        // compact rows are widened inside the dot products rather than 
+        // into P
+        for (size_t i = 0; i < A::size; ++i) {
+            D(i, sample) = (_backwardrow(i, sample, first) + ... 
+                         +  _backwardrow(i, sample, connections)) 
+                         * activation::derivative(Z(sample, i));
+        }
+    }
+
+
+
+
+    template<class A, class B, class O, class S>
+    static inline int _renormalize(Connection<A,B,O,S> &connection) {
+        connection.W *= connection.scale;
+        connection.scale = 1;
+        connection.store(connection.W, 0, A::size);
         return 0;
     }
 
+
     template<class... C>
-    void batch_reset_gradients(C&... connections) {
-        pass( _batch_reset_gradients(connections)... );
+    void renormalize(C&... connections) {
+        pass( _renormalize(connections)... );
     }
 
-    
 
-    template<class A, class B, class... C>
-    void batch_backwardstep(Connection<A,B> &first, C&... connections) {
-        first.tmp = _backwardstep(first, connections...);
-        for (int i = 0; i < A::size; ++i) {
-            first.lower.D(i, 0) += first.tmp(i, 0) * dsigmoid(first.lower.Z(0, i));
+    //
+    // adaptive optimizers: begin() advances a block of state by one update
+    // and returns the learning rate to use for it, update() then applies row
+    // i of the summed gradient g to the parameter row w and row i of the
+    // state. each row of W, the state and g is visited once, while it is in
+    // cache, with all of the element-wise work done in that visit
+    //
+    template<class Scalar, class R>
+    static constexpr Scalar _ratio() {
+        return Scalar(R::num) / Scalar(R::den);
+    }
+
+
+    template<class Epsilon>
+    struct AdaGrad {
+
+        template<class State, class Scalar>
+        static inline Scalar begin(State &, const Scalar eta) {
+            return eta;
+        }
+
+        template<class W, class State, class G, class Scalar>
+        static inline void update(W &&w, State &state, const int i, 
+                                  const G &g, const Scalar rate) {
+            auto v = state.V.row(i).array();
+            v += g.array().square();
+            w.array() -= rate * g.array() 
+                       / (v.sqrt() + _ratio<Scalar, Epsilon>());
+        }
+    };
+
+
+    template<class Decay, class Epsilon>
+    struct RMSProp {
+
+        template<class State, class Scalar>
+        static inline Scalar begin(State &, const Scalar eta) {
+            return eta;
+        }
+
+        template<class W, class State, class G, class Scalar>
+        static inline void update(W &&w, State &state, const int i, 
+                                  const G &g, const Scalar rate) {
+            const Scalar rho = _ratio<Scalar, Decay>();
+            auto v = state.V.row(i).array();
+            v = rho * v + (1 - rho) * g.array().square();
+            w.array() -= rate * g.array() 
+                       / (v.sqrt() + _ratio<Scalar, Epsilon>());
+        }
+    };
+
+
+    // the bias correction of both moments is folded into the rate
+    template<class Beta1, class Beta2, class Epsilon>
+    struct Adam {
+
+        template<class State, class Scalar>
+        static inline Scalar begin(State &state, const Scalar eta) {
+            state.B1 *= _ratio<Scalar, Beta1>();
+            state.B2 *= _ratio<Scalar, Beta2>();
+            return eta * std::sqrt(1 - state.B2) / (1 - state.B1);
+        }
+
+        template<class W, class State, class G, class Scalar>
+        static inline void update(W &&w, State &state, const int i, 
+                                  const G &g, const Scalar rate) {
+            const Scalar beta1 = _ratio<Scalar, Beta1>();
+            const Scalar beta2 = _ratio<Scalar, Beta2>();
+            auto m = state.M.row(i).array();
+            auto v = state.V.row(i).array();
+            m = beta1 * m + (1 - beta1) * g.array();
+            v = beta2 * v + (1 - beta2) * g.array().square();
+            w.array() -= rate * m / (v.sqrt() + _ratio<Scalar, Epsilon>());
+        }
+    };
+
+
+    // list the inputs that are nonzero somewhere in the minibatch
+    template<size_t N, class Scalar>
+    static inline const std::vector<int> &_activeinputs(SparseInputLayer<N, Scalar> &layer) {
+        layer.active.clear();
+        for (int i = 0; i < N; ++i) {
+            if ((layer.Z.col(i).array() != Scalar(0)).any()) {
+                layer.active.push_back(i);
+            }
         }
+        return layer.active;
     }
 
 
+    // G = factor * the gradient for the rows of W from `row` on, summed
+    // over the minibatch one tile of samples at a time. the inner dimension
+    // of each product stays at most NN_TILE_ROWS, so Eigen's packing buffers
+    // fit on the stack whatever the batch size
+    template<class A, class B, class O, class S, class Tile, class Scalar>
+    static inline void _gradient(Tile &&G, const size_t row, const Scalar factor,
+                                 Connection<A,B,O,S> &connection) {
+        const auto &Z = connection.lower.Z;
+        const auto &D = connection.upper.D;
+        for (size_t s = 0; s < Z.rows(); s += NN_TILE_ROWS) {
+            const size_t n = std::min<size_t>(NN_TILE_ROWS, Z.rows() - s);
+            const auto z = Z.block(s, row, n, G.rows()).transpose();
+            const auto d = D.middleCols(s, n).transpose();
+            if (s == 0) {
+                G.noalias() = factor * z * d;
+            } else {
+                G.noalias() += factor * z * d;
+            }
+        }
+    }
 
 
-    template<class A, class B>
+    // rank-1 update of row i of W and M for a single-sample minibatch: the
+    // gradient row is z_i * d^T, so it is formed directly in the layout of
+    // W with no product temporary
+    template<class A, class B, class Scalar, class S>
+    static inline void _updaterow(const int i, const Scalar g, 
+                                  const Scalar alpha, const Scalar step,
+                                  Connection<A,B,Momentum,S> &connection) {
+        const auto d = connection.upper.D.col(0).transpose();
+        auto W = connection.W.row(i);
+        auto M = connection.M.row(i);
+        W += step * (alpha * M + g * d);
+        M = g * d;
+        connection.store(connection.W, i, 1);
+    }
+
+
+    // the effective weights scale * W become weight_factor * (scale * W
+    // + alpha * M - eta * gradient), with M = -eta * gradient. the decay
+    // goes into the scale, and W and M are updated one tile of rows at a
+    // time so each is read and written once while the gradient for the
+    // tile is computed in place. each thread owns a band of rows of W and
+    // sums their gradient over the whole minibatch, so nothing needs to be
+    // reduced across threads
+    template<class A, class B, class Scalar, class S>
+    static inline void _updatetiles(const Scalar eta, const Scalar alpha,
+                                    Connection<A,B,Momentum,S> &connection) {
+        const Scalar step = Scalar(1) / connection.scale;
+        const size_t work = connection.lower.Z.rows() * connection.W.size();
+        if (connection.lower.Z.rows() == 1) {
+            _parallel(A::size, work, 
+                      [&](const size_t begin, const size_t end, int) {
+                for (size_t i = begin; i < end; ++i) {
+                    _updaterow(i, -eta * connection.lower.Z(0, i), alpha, step, 
+                               connection);
+                }
+            }, _threads(connection));
+            return;
+        }
+
+        _parallel(A::size, work, 
+                  [&](const size_t begin, const size_t end, int) {
+            for (size_t row = begin; row < end; row += NN_TILE_ROWS) {
+                const size_t rows = std::min<size_t>(NN_TILE_ROWS, end - row);
+                auto W = connection.W.middleRows(row, rows);
+                auto M = connection.M.middleRows(row, rows);
+                W += alpha * step * M;
+                _gradient(M, row, -eta, connection);
+                W += step * M;
+                connection.store(connection.W, row, rows);
+            }
+        }, _threads(connection));
+    }
+
+
+    template<class A, class B, class Scalar, class S>
+    static inline void _updatematrix(const Scalar eta, const Scalar alpha,
+                                     Connection<A,B,Momentum,S> &connection) {
+        _updatetiles(eta, alpha, connection);
+    }
+
+
+    // rows of the gradient for inputs that are zero across the minibatch are
+    // zero, so only rows with a nonzero input or leftover momentum change.
+    // once most inputs are nonzero somewhere in the minibatch the dense
+    // tiled update is faster, and it leaves the momentum of the other rows
+    // at zero just the same
+    template<size_t N, class B, class Scalar, class S>
+    static inline void _updatematrix(const Scalar eta, const Scalar alpha,
+                                     Connection<SparseInputLayer<N, Scalar>, B, Momentum, S> &connection) {
+        const auto &Z = connection.lower.Z;
+        const auto &active = _activeinputs(connection.lower);
+        auto &R = connection.R;
+        if (active.size() > NN_SPARSE_DENSITY * N) {
+            _updatetiles(eta, alpha, connection);
+            R.assign(active.begin(), active.end());
+            return;
+        }
+
+        const Scalar step = Scalar(1) / connection.scale;
+
+        // momentum rows that are not active this time decay to zero
+        auto next = active.begin();
+        for (int i : R) {
+            while (next != active.end() && *next < i) ++next;
+            if (next == active.end() || *next != i) {
+                connection.W.row(i) += alpha * step * connection.M.row(i);
+                connection.M.row(i).setZero();
+                connection.store(connection.W, i, 1);
+            }
+        }
+
+        _parallel(active.size(), active.size() * Z.rows() * B::size,
+                  [&](const size_t begin, const size_t end, int) {
+            for (size_t k = begin; k < end; ++k) {
+                const int i = active[k];
+                if (Z.rows() == 1) {
+                    _updaterow(i, -eta * Z(0, i), alpha, step, connection);
+                    continue;
+                }
+                auto W = connection.W.row(i);
+                auto M = connection.M.row(i);
+                W += alpha * step * M;
+                _gradient(M, i, -eta, connection);
+                W += step * M;
+                connection.store(connection.W, i, 1);
+            }
+        }, _threads(connection));
+
+        R.assign(active.begin(), active.end());
+    }
+
+
+    // adaptive optimizers - the gradient for a tile of rows goes into the
+    // thread's scratch tile, then each row of W and the state is updated
+    // once. the step is divided by the scale since W holds W_eff / scale
+    template<class A, class B, class O, class S, class Scalar>
+    static inline void _updatetiles(const Scalar eta, const Scalar,
+                                    Connection<A,B,O,S> &connection) {
+        typedef OptimizerTile<Scalar, A::size, B::size> tile;
+        const Scalar rate = O::begin(connection, eta) / connection.scale;
+        _parallel(A::size, connection.lower.Z.rows() * connection.W.size(),
+                  [&](const size_t begin, const size_t end, const int t) {
+            for (size_t row = begin; row < end; row += NN_TILE_ROWS) {
+                const size_t rows = std::min<size_t>(NN_TILE_ROWS, end - row);
+                auto G = connection.G.middleRows(t * tile::rows, rows);
+                _gradient(G, row, Scalar(1), connection);
+                for (size_t r = 0; r < rows; ++r) {
+                    O::update(connection.W.row(row + r), connection, row + r, 
+                              G.row(r), rate);
+                }
+                connection.store(connection.W, row, rows);
+            }
+        }, _threads(connection));
+    }
+
+
+    template<class A, class B, class O, class S, class Scalar>
+    static inline void _updatematrix(const Scalar eta, const Scalar alpha,
+                                     Connection<A,B,O,S> &connection) {
+        _updatetiles(eta, alpha, connection);
+    }
+
+
+    // AdaGrad leaves a row and its state alone when the row's gradient is
+    // zero, so with sparse inputs only the active rows need updating. RMSProp
+    // and Adam decay their state, and Adam keeps moving the weights, on
+    // every step, so they always take the dense path above
+    template<size_t N, class B, class E, class S, class Scalar>
+    static inline void _updatematrix(const Scalar eta, const Scalar alpha,
+                                     Connection<SparseInputLayer<N, Scalar>, B, AdaGrad<E>, S> &connection) {
+        typedef AdaGrad<E> O;
+        const auto &Z = connection.lower.Z;
+        const auto &active = _activeinputs(connection.lower);
+        if (active.size() > NN_SPARSE_DENSITY * N) {
+            _updatetiles(eta, alpha, connection);
+            return;
+        }
+
+        typedef OptimizerTile<Scalar, N, B::size> tile;
+        const Scalar rate = O::begin(connection, eta) / connection.scale;
+        _parallel(active.size(), active.size() * Z.rows() * B::size,
+                  [&](const size_t begin, const size_t end, const int t) {
+            auto G = connection.G.row(t * tile::rows);
+            for (size_t k = begin; k < end; ++k) {
+                const int i = active[k];
+                _gradient(G, i, Scalar(1), connection);
+                O::update(connection.W.row(i), connection, i, G, rate);
+                connection.store(connection.W, i, 1);
+            }
+        }, _threads(connection));
+    }
+
+
+    // biases are not scaled or decayed
+    template<class A, class B, class Scalar, class S>
+    static inline void _updatebias(const Scalar eta, const Scalar alpha,
+                                   Connection<A,B,Momentum,S> &connection) {
+        auto &M = connection.bias.M;
+        connection.upper.B += alpha * M;
+        M = -eta * connection.upper.D.rowwise().sum().transpose();
+        connection.upper.B += M;
+    }
+
+
+    template<class A, class B, class O, class S, class Scalar>
+    static inline void _updatebias(const Scalar eta, const Scalar,
+                                   Connection<A,B,O,S> &connection) {
+        auto &bias = connection.bias;
+        const Scalar rate = O::begin(bias, eta);
+        // into the first row of the existing scratch, which is never resized
+        bias.G.row(0).noalias() = connection.upper.D.rowwise().sum().transpose();
+        O::update(connection.upper.B.row(0), bias, 0, bias.G.row(0), rate);
+    }
+
+
+    // weight decay only shrinks the scale
+    template<class A, class B, class O, class S>
+    static inline int _decayweights(const double weight_factor,
+                                    Connection<A,B,O,S> &connection) {
+        typedef typename Connection<A,B,O,S>::Scalar Scalar;
+        if (weight_factor < 1) {
+            connection.scale *= Scalar(weight_factor);
+            if (connection.scale < Scalar(NN_MIN_WEIGHT_SCALE)) {
+                _renormalize(connection);
+            }
+        }
+        return 0;
+    }
+
+
+    template<class A, class B, class O, class S>
     static inline int _updateweights(const double eta, const double alpha, 
                                      const double weight_factor, 
-                                     Connection<A,B> &connection) {
-
-        connection.W += alpha * connection.M;
-        connection.M = -eta * (connection.upper.D * connection.lower.Z).transpose();
-        connection.W += connection.M;
-        if (weight_factor < 1) connection.W *= weight_factor;
-        connection.upper.B += alpha * connection.upper.M;
-        connection.upper.M = -eta * connection.upper.D.transpose();
-        connection.upper.B += connection.upper.M;
+                                     Connection<A,B,O,S> &connection) {
+        typedef typename Connection<A,B,O,S>::Scalar Scalar;
+
+        _updatematrix(Scalar(eta), Scalar(alpha), connection);
+        _decayweights(weight_factor, connection);
+        _updatebias(Scalar(eta), Scalar(alpha), connection);
         return 0;
     }
     
@@ -140,12 +1000,236 @@ namespace nn {
     }
 
 
+    // plain SGD step for one sample, with no locking: rows of W that other
+    // threads are updating at the same time may lose or mix some of their
+    // increments, which hogwild training tolerates. scale is only read.
+    // rows for zero inputs don't change, so only the others are updated
+    // and narrowed
+    template<class A, class B, class O, class S>
+    static inline int _updatesample(const size_t sample, const double eta,
+                                    Connection<A,B,O,S> &connection) {
+        typedef typename Connection<A,B,O,S>::Scalar Scalar;
+        const auto z = connection.lower.Z.row(sample);
+        const auto d = connection.upper.D.col(sample).transpose();
+        const Scalar step = Scalar(-eta) / connection.scale;
+        for (int i = 0; i < A::size; ++i) {
+            if (z(i) != Scalar(0)) {
+                connection.W.row(i) += (step * z(i)) * d;
+                connection.store(connection.W, i, 1);
+            }
+        }
+        connection.upper.B += Scalar(-eta) * d;
+        return 0;
+    }
+
+
+    template<class... C>
+    void updatesample(const size_t sample, const double eta, C&... connections) {
+        pass( _updatesample(sample, eta, connections)... );
+    }
+
+
+    template<class... C>
+    void decayweights(const double weight_factor, C&... connections) {
+        pass( _decayweights(weight_factor, connections)... );
+    }
+
+
+    template<class A, class B, class O, class S>
+    void copyweights(Connection<A,B,O,S> &to, const Connection<A,B,O,S> &from) {
+        to.W = from.W;
+        to.scale = from.scale;
+        to.store(to.W, 0, A::size);
+        to.upper.B = from.upper.B;
+    }
+
+
+
+    template<class A, class B, class O, class S>
+    void quantize(QuantizedConnection<A,B> &q, const Connection<A,B,O,S> &connection) {
+        for (int j = 0; j < B::size; ++j) {
+            const auto w = connection.W.col(j).template cast<float>() 
+                         * float(connection.scale);
+            const float max = w.cwiseAbs().maxCoeff();
+            q.S(j) = max > 0 ? max / 127 : 1;
+            q.Q.row(j).head(A::size) = (w.transpose() / q.S(j)).array().round()
+                                                        .template cast<int8_t>();
+            q.R(j) = q.Q.row(j).template cast<int32_t>().sum();
+        }
+        q.low = 0;
+        q.high = 1;
+        q.step = 1.0f / 127;
+        q.zero = 0;
+    }
+
+
+    template<class A, class B>
+    static inline int _calibrate(QuantizedConnection<A,B> &q) {
+        q.low = std::min(q.low, q.lower.Z.minCoeff());
+        q.high = std::max(q.high, q.lower.Z.maxCoeff());
+        q.step = float(q.high - q.low) / 127;
+        q.zero = std::min(127, std::max(0, int(std::round(-q.low / q.step))));
+        return 0;
+    }
+
+
+    template<class... Q>
+    void calibrate(Q&... connections) {
+        pass( _calibrate(connections)... );
+    }
+
+
+    // sum of x[i] * w[i] over whole 32 byte blocks, with x in [0, 127]
+    static inline int32_t _dot(const uint8_t *x, const int8_t *w, const int n) {
+    #ifdef __AVX2__
+        __m256i acc = _mm256_setzero_si256();
+        for (int i = 0; i < n; i += 32) {
+            const __m256i a = _mm256_loadu_si256((const __m256i *)(x + i));
+            const __m256i b = _mm256_loadu_si256((const __m256i *)(w + i));
+        #if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+            acc = _mm256_dpbusd_epi32(acc, a, b);
+        #else
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(
+                    _mm256_maddubs_epi16(a, b), _mm256_set1_epi16(1)));
+        #endif
+        }
+        __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), 
+                                    _mm256_extracti128_si256(acc, 1));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1,0,3,2)));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2,3,0,1)));
+        return _mm_cvtsi128_si32(sum);
+    #else
+        int32_t sum = 0;
+        for (int i = 0; i < n; ++i) {
+            sum += int32_t(x[i]) * int32_t(w[i]);
+        }
+        return sum;
+    #endif
+    }
+
+
+    // quantize a tile of samples of the lower layer, then add each upper
+    // unit's dequantized dot product
+    template<class A, class B, class Tile>
+    inline static int _forwardstep(Tile &tile, const size_t row,
+                                   QuantizedConnection<A,B> &q) {
+        typedef QuantizedConnection<A,B> connection;
+        for (int r = 0; r < tile.rows(); ++r) {
+            q.X.row(row + r).head(A::size) = 
+                    (q.lower.Z.row(row + r).array().template cast<float>() / q.step 
+                     + float(q.zero)).round().max(0.0f).min(127.0f)
+                                     .template cast<uint8_t>();
+            const uint8_t *x = q.X.row(row + r).data();
+            for (int j = 0; j < B::size; ++j) {
+                const int32_t dot = _dot(x, q.Q.row(j).data(), connection::K);
+                tile(r, j) += q.S(j) * q.step * float(dot - q.zero * q.R(j));
+            }
+        }
+        return 0;
+    }
+
+
+    template<class A, class B>
+    static inline int _reserve(QuantizedConnection<A,B> &q) {
+        if (q.X.rows() != q.lower.Z.rows()) {
+            q.X.setZero(q.lower.Z.rows(), QuantizedConnection<A,B>::K);
+        }
+        return 0;
+    }
+
+
+    template<class A, class B, class... Q>
+    void forwardstep(QuantizedConnection<A,B> &first, Q&... connections) {
+        auto &Z = first.upper.Z;
+        pass( _reserve(first), _reserve(connections)... );
+        _parallel(Z.rows(), Z.rows() * A::size * B::size,
+                  [&](const size_t begin, const size_t end, int) {
+            for (size_t row = begin; row < end; row += NN_TILE_ROWS) {
+                auto tile = Z.middleRows(row, std::min<size_t>(NN_TILE_ROWS, 
+                                                               end - row));
+                tile.rowwise() = first.upper.B.row(0);
+                pass( _forwardstep(tile, row, first),
+                      _forwardstep(tile, row, connections)... );
+                B::activation::forward(tile);
+            }
+        });
+    }
+
 
     // error amount - sum of squares
-    template<size_t N>
-    double error(const Layer<N> &out) {
+    template<size_t N, class Scalar, class F>
+    Scalar error(const OutputLayer<N, Scalar, F> &out) {
         return (out.Y-out.Z).squaredNorm();
     }
+
+
+    // cross-entropy summed over the minibatch - activations are clamped to
+    // the smallest normal value so a saturated output cannot produce inf
+    template<size_t N, class Scalar, class F>
+    Scalar log_loss(const OutputLayer<N, Scalar, F> &out) {
+        return -(out.Y.array() * out.Z.array().max(
+                std::numeric_limits<Scalar>::min()).log()).sum();
+    }
+}
+
+
+namespace Eigen {
+    namespace internal {
+
+        template<class Scalar>
+        struct functor_traits<nn::sigmoid_op<Scalar>> {
+            enum {
+                Cost = 6 * NumTraits<Scalar>::MulCost,
+                PacketAccess = packet_traits<Scalar>::HasExp &&
+                               packet_traits<Scalar>::HasDiv
+            };
+        };
+
+        template<class Scalar>
+        struct functor_traits<nn::dsigmoid_op<Scalar>> {
+            enum {
+                Cost = NumTraits<Scalar>::AddCost + NumTraits<Scalar>::MulCost,
+                PacketAccess = packet_traits<Scalar>::HasSub &&
+                               packet_traits<Scalar>::HasMul
+            };
+        };
+
+        template<class Scalar>
+        struct functor_traits<nn::tanh_op<Scalar>> {
+            enum {
+                Cost = 8 * NumTraits<Scalar>::MulCost,
+                PacketAccess = functor_traits<nn::sigmoid_op<Scalar>>::PacketAccess
+            };
+        };
+
+        template<class Scalar>
+        struct functor_traits<nn::dtanh_op<Scalar>> {
+            enum {
+                Cost = NumTraits<Scalar>::AddCost + NumTraits<Scalar>::MulCost,
+                PacketAccess = packet_traits<Scalar>::HasSub &&
+                               packet_traits<Scalar>::HasMul
+            };
+        };
+
+        template<class Scalar, class Slope>
+        struct functor_traits<nn::relu_op<Scalar, Slope>> {
+            enum {
+                Cost = NumTraits<Scalar>::AddCost + NumTraits<Scalar>::MulCost,
+                PacketAccess = packet_traits<Scalar>::HasMax &&
+                               packet_traits<Scalar>::HasMul
+            };
+        };
+
+        template<class Scalar, class Slope>
+        struct functor_traits<nn::drelu_op<Scalar, Slope>> {
+            enum {
+                Cost = 3 * NumTraits<Scalar>::AddCost + 2 * NumTraits<Scalar>::MulCost,
+                PacketAccess = packet_traits<Scalar>::HasMin &&
+                               packet_traits<Scalar>::HasMax &&
+                               packet_traits<Scalar>::HasMul
+            };
+        };
+    }
 }
 
 #endif